@@ -0,0 +1,26 @@
+// generated by tools/gen_assets.py from assets/ - do not edit
+#pragma once
+#include <Arduino.h>
+
+// styles.css - 459 bytes, 259 gzipped
+#define ASSET_STYLES_VERSION "07272cf3a911"
+#define ASSET_STYLES_ETAG "\"" ASSET_STYLES_VERSION "\""
+const uint8_t ASSET_STYLES_GZ[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x6d, 0x90, 0xc1, 0x6e, 0x84, 0x30,
+  0x0c, 0x44, 0xef, 0x7c, 0x85, 0xa5, 0x6a, 0x2f, 0x95, 0x58, 0xb1, 0xdd, 0xaa, 0x87, 0xe4, 0x6b,
+  0x02, 0x18, 0xb0, 0x1a, 0x62, 0x14, 0xcc, 0x2e, 0x2d, 0xe2, 0xdf, 0x37, 0x89, 0xb2, 0x55, 0x51,
+  0xab, 0xdc, 0x5e, 0xc6, 0x33, 0x1e, 0xbf, 0xc2, 0xd6, 0xb1, 0x93, 0x72, 0xa6, 0x6f, 0x54, 0x70,
+  0x79, 0x9f, 0x44, 0xef, 0x85, 0xc9, 0xf0, 0x8e, 0xd4, 0x0f, 0xa2, 0xa0, 0x66, 0xdb, 0x06, 0x2c,
+  0xa6, 0xb6, 0x08, 0xdb, 0x68, 0x7c, 0x4f, 0xae, 0xb4, 0xd8, 0x89, 0x32, 0x8b, 0xb0, 0xce, 0xc0,
+  0x27, 0x71, 0x22, 0x7b, 0x71, 0x9e, 0x78, 0x26, 0x21, 0x76, 0xb0, 0xdd, 0xa9, 0x95, 0x41, 0xc1,
+  0x47, 0x75, 0xd2, 0x90, 0xa5, 0x35, 0x8b, 0xf0, 0x18, 0xf2, 0xaa, 0x69, 0xd5, 0xf0, 0x94, 0x2a,
+  0xf0, 0x68, 0x8d, 0xd0, 0x0d, 0x7f, 0x84, 0x29, 0x04, 0x92, 0x27, 0x1c, 0x62, 0xe0, 0x99, 0x23,
+  0x24, 0x71, 0x29, 0xc1, 0x55, 0x4a, 0x63, 0xa9, 0x0f, 0x2e, 0x0d, 0x3a, 0x41, 0xaf, 0xe1, 0x6f,
+  0x07, 0xf8, 0xd5, 0xf5, 0xad, 0x4a, 0x5d, 0xcf, 0xc9, 0xef, 0x68, 0x90, 0x50, 0xfc, 0xeb, 0x98,
+  0x83, 0xd3, 0xf1, 0x44, 0x71, 0x2c, 0xfb, 0xc8, 0x97, 0x0d, 0x84, 0x24, 0x8c, 0x35, 0x51, 0x3e,
+  0xa2, 0x5b, 0x48, 0x70, 0xfc, 0x7f, 0x9d, 0xda, 0x34, 0x9f, 0xbd, 0xe7, 0xc5, 0xb5, 0x65, 0xc3,
+  0x96, 0xbd, 0x82, 0x17, 0xec, 0xe2, 0xd3, 0xd0, 0x2c, 0x7e, 0x8e, 0x60, 0x62, 0xca, 0x5a, 0xf6,
+  0x2d, 0x06, 0x70, 0x99, 0x56, 0x98, 0xd9, 0x52, 0x0b, 0xb5, 0x0d, 0xe3, 0x31, 0x64, 0x48, 0x85,
+  0xae, 0x15, 0x6c, 0x43, 0xae, 0x76, 0x8d, 0x57, 0xdc, 0x8b, 0x07, 0x5f, 0x2a, 0x06, 0xf5, 0xcb,
+  0x01, 0x00, 0x00,
+};
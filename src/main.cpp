@@ -1,44 +1,85 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
+#include <time.h>
 #include <Adafruit_Sensor.h>
 #include <OneWire.h> 
 #include <DallasTemperature.h>
 #include <DHT.h>
 #include <DHT_U.h>
 #include "vars.h"
+#include "assets.h"
 #ifdef NETWORK_ETHERNET
   #include <SPI.h>
   #include <Ethernet.h>
 #endif
 #ifdef NETWORK_WIFI
   #include <ESP8266WiFi.h>
-  #include <ESP8266HTTPClient.h>
   #include <ESP8266WebServer.h>
 #endif
 
-#define VERSION_NUMBER "20231214T1030"
-#define VERSION_LASTCHANGE "Centralize formattting of samples"
+#define VERSION_NUMBER "20261017T0900"
+#define VERSION_LASTCHANGE "Live configuration reload"
 
 //#define PIN_WATCHDOG 13                 // pin where we connect to a 555 timer watch dog circuit
 //#define PIN_PRINT_LED 14
 //#define PIN_HTTP_LED 16
-#define DS18B20_TEMP_PRECISION 12        // 12 bits precision
 #define DHT_TYPE DHT22
 #define DELAY_CONNECT_ATTEMPT 10000L    // delay between attempting wifi reconnect or if no ethernet link, in milliseconds
+#define DELAY_CONNECT_BACKOFF_MAX 300000L // max delay between wifi connection attempts, in milliseconds
+#define WIFI_CONNECT_TIMEOUT 20000L     // how long a wifi connection attempt may take, in milliseconds
+#define DELAY_DNS_CACHE 300000L         // how long a resolved endpoint address is used before resolving again, in milliseconds
+#define DELAY_QUEUE_REPLAY 5000L        // time between replaying batches of queued payloads, in milliseconds
+#define QUEUE_REPLAY_BATCH 5            // max number of queued payloads replayed at a time
+#define QUEUE_SEGMENT_BYTES 4096        // max size of a queue file - one flash block
+#define QUEUE_MAX_SEGMENTS 64           // max number of queue files before the oldest is dropped
+#define HTTP_CONNECT_TIMEOUT 2000L      // how long to block resolving and connecting to the endpoint, in milliseconds
+#define HTTP_REQUEST_DEADLINE 15000L    // hard limit on sending a post and reading the response, in milliseconds
+#define HTTP_SLICE_BYTES 1460           // max bytes sent or received per loop(), keeps loop() time bounded
+#define HTTP_RESPONSE_PREFIX 256        // bytes of a response body kept for diagnostics, the rest is discarded
+#define MQTT_KEEPALIVE 60               // MQTT keep alive, in seconds
+#define DEFAULT_MQTT_TOPIC "sensorcentral"
+#define BREAKER_FAILURES 3              // failed posts in a row before the circuit breaker opens
+#define DELAY_BACKOFF_MIN 30000UL       // first delay after the circuit breaker opens, in milliseconds (randomized)
+#define DELAY_BACKOFF_MAX 3600000UL     // max delay between attempts while the endpoint is down, in milliseconds
+#define MIN_CONTROL_DELAY 1000UL        // shortest poll / post delay the endpoint may set, in milliseconds
+#define MAX_CONTROL_PAUSE 86400000UL    // longest pause the endpoint may ask for, in milliseconds
 #define DELAY_TURNOFF_AP 300000L        // delay after restart before turning off access point, in milliseconds
 #define DELAY_BLINK 200L                // how long a led blinks, in milliseconds
 #define DELAY_PAT_WATCHDOG 200L         // how long a watchdog pat lasts, in milliseconds
+#define DELAY_DHT22_MIN_INTERVAL 2000L  // minimum time between two DHT22 bus transactions, in milliseconds
+#define DELAY_DS18B20_RESCAN 300000L    // how often to search the DS18B20 buses for added/removed sensors, in milliseconds
 #define DEFAULT_DELAY_PRINT 10000L      // 
 #define DEFAULT_DELAY_POLL 10000L       // 
 #define DEFAULT_DELAY_POST 120000L      // 
+#define DEFAULT_DELAY_HEARTBEAT 900000L // max time between posts when reporting by exception, in milliseconds
+#define DEFAULT_DELAY_BATCH 600000L     // max age of the oldest snapshot in a batch, in milliseconds
 #define MAX_SENSORS 10                  // maximum number of sensors we can connect
 #define TEMP_DECIMALS 1                 // 1 decimals of output
 #define HUM_DECIMALS 1                  // 1 decimals of output
+#define HISTORY_MEMORY_BYTES 20480      // memory set aside for the sample history, in bytes
+#define HISTORY_SCALE 100               // history keeps values as fixed point, 100 = centi-degrees / centi-percent
+#define HISTORY_NO_VALUE INT16_MIN      // marks a missing value in the history
+#define FILTER_WINDOW 3                 // number of raw samples the median is taken over
+#define FILTER_SPIKE_LIMIT 10.0         // raw samples further than this from the filtered value are spikes
+#define ALL_SENSORS 0xFFFFFFFFUL         // sensor mask selecting every sensor
+#define WEB_CHUNK_SIZE 256              // size of the buffer used when streaming web responses, in bytes
+#define EVENT_SUBSCRIBERS 3             // max number of concurrent /events connections
+#define EVENT_MAX_SKIPPED 3             // events in a row a subscriber has no room for before it's dropped
+#define EVENT_KEEPALIVE 15000L          // max time between writes to an event subscriber, in milliseconds
+
+// payload encodings
+#define ENCODING_JSON 0
+#define ENCODING_MSGPACK 1
+
+// transports
+#define TRANSPORT_HTTP 0
+#define TRANSPORT_MQTT 1
 
 // define struct to hold general config
-#define CONFIGURATION_VERSION 4
-struct {
+#define CONFIGURATION_VERSION 10
+struct Configuration {
   uint8_t version = CONFIGURATION_VERSION;
   char endpoint[64] = "";
   char jwt[650] = "";
@@ -46,6 +87,23 @@ struct {
   unsigned long delayPrint = 0L;
   unsigned long delayPoll = 0L;
   unsigned long delayPost = 0L;
+  uint8_t resolution = 0;                             // DS18B20 resolution in bits (9-12), 0 means derive from TEMP_DECIMALS
+  DeviceAddress resolutionAddresses[MAX_SENSORS] = {};  // DS18B20 sensors with a resolution of their own...
+  uint8_t resolutions[MAX_SENSORS] = {};                // ...and that resolution in bits
+  bool aggregates = false;                            // add min/max/mean/stddev since last post to the payload
+  float deadband = 0;                                 // report by exception when a sensor moves more than this, 0 means post every delayPost
+  unsigned long delayHeartbeat = 0L;                  // max time between posts when reporting by exception
+  uint16_t batchSize = 0;                             // post every batchSize snapshots in one payload, 0 or 1 means no batching
+  unsigned long delayBatch = 0L;                      // max age of the oldest snapshot before a batch is posted
+  uint8_t encoding = 0;                               // payload encoding - ENCODING_JSON or ENCODING_MSGPACK
+  bool deltaEncoding = false;                         // send batched values as differences to the previous snapshot
+  uint8_t transport = 0;                              // TRANSPORT_HTTP posts to endpoint, TRANSPORT_MQTT publishes to mqttBroker
+  char mqttBroker[64] = "";                           // host[:port]
+  char mqttTopic[32] = "";                            // messages go to <mqttTopic>/<device>[/<sensor>]
+  char mqttUser[32] = "";
+  char mqttPassword[64] = "";
+  uint8_t mqttQos = 0;                                // 0 or 1
+  bool mqttPerSensor = false;                         // publish data as a message per sensor
 } configuration;
 
 // **** network *****
@@ -58,13 +116,89 @@ struct {
     char password[20] = "";
     bool keep_ap_on = false;
   } wifi_data;
+
+  // wifi connection manager state
+  #define NET_OFFLINE 0                 // waiting for the next connection attempt
+  #define NET_CONNECTING 1
+  #define NET_ONLINE 2
+  struct {
+    uint8_t state = NET_OFFLINE;
+    unsigned long since = 0;            // millis() when state was entered
+    unsigned long backoff = 0;          // delay after a failed attempt before the next one
+    unsigned long offlineSince = 0;     // millis() when the connection was lost
+    uint32_t attempts = 0;              // connection attempts since boot
+    uint32_t outages = 0;               // established connections lost since boot
+    unsigned long lastReconnect = 0;    // duration of the last outage, in milliseconds
+    unsigned long longestOutage = 0;
+  } network;
 #endif
 #ifdef NETWORK_ETHERNET
-  EthernetClient client;
   bool didEthernetBegin = false;
 #endif
 
-unsigned long lastConnectAttempt = millis();
+// endpoint (or MQTT broker) parsed from the configuration with a cached 
+// address and a connection kept open between posts
+struct {
+  char host[64] = "";
+  uint16_t port = 80;
+  char path[64] = "/";
+  IPAddress address;
+  bool resolved = false;
+  unsigned long resolvedAt = 0L;
+  unsigned long lastWrite = 0L;
+#ifdef NETWORK_WIFI
+  WiFiClient client;
+#endif
+#ifdef NETWORK_ETHERNET
+  EthernetClient client;
+#endif
+} httpEndpoint;
+
+// post in flight - sent and received a slice at a time by servicePost() so 
+// loop() keeps running while the endpoint is slow to answer
+#define POST_IDLE 0
+#define POST_SENDING 1
+#define POST_RECEIVING 2
+#define RESPONSE_STATUS 0
+#define RESPONSE_HEADERS 1
+#define RESPONSE_BODY 2                 // remaining bytes of a Content-Length body
+#define RESPONSE_BODY_TO_CLOSE 3        // body without length - ends when server closes
+#define RESPONSE_CHUNK_SIZE 4
+#define RESPONSE_CHUNK_DATA 5
+#define RESPONSE_CHUNK_END 6
+#define RESPONSE_TRAILER 7
+#define RESPONSE_MQTT_TYPE 8
+#define RESPONSE_MQTT_LENGTH 9
+#define RESPONSE_MQTT_BODY 10
+struct {
+  uint8_t state = POST_IDLE;
+  unsigned long started = 0L;
+  size_t bodyLength = 0;
+  size_t requestLength = 0;             // headers + body
+  size_t sent = 0;
+  bool retried = false;                 // already retried on a new connection
+  uint8_t part = RESPONSE_STATUS;       // part of the response being read
+  char line[128];
+  uint8_t lineLength = 0;
+  bool received = false;                // any response bytes seen
+  int code = -1;
+  bool keepAlive = false;
+  bool chunked = false;
+  long contentLength = -1;
+  unsigned long retryAfter = 0L;        // Retry-After of the response, in milliseconds
+  size_t remaining = 0;
+  size_t stored = 0;                    // bytes of the body kept in lastHttpResponse
+  bool mqttConnect = false;             // request starts with an MQTT CONNECT
+  uint8_t mqttType = 0;                 // type of the MQTT packet being read
+  uint8_t pending = 0;                  // MQTT acknowledgements still to come
+  uint16_t packetId = 0;                // MQTT packet id of the first message
+  uint32_t acked = 0;                   // messages of this post acknowledged, bit per packet id
+} httpPost;
+
+bool isPosting() {
+  return httpPost.state != POST_IDLE;
+}
+
 unsigned long lastPostData = millis();
 unsigned long lastPrint = millis();
 unsigned long lastRead = millis();
@@ -72,18 +206,35 @@ boolean startedRead = false;
 boolean startedPrint = false;
 boolean startedPostData = false;
 boolean justReset = true;
-uint8_t reconnect;
 int lastHttpResponseCode = 0;
-char lastHttpResponse[2048] = ""; 
-char jsonBuffer[2048];
+char lastHttpResponse[HTTP_RESPONSE_PREFIX + 1] = "";  // start of the last response body
+unsigned long lastHttpDuration = 0L;  // how long the last post took, in milliseconds
+bool lastHttpReused = false;          // whether the last post reused an open connection
 
 // sensor data
 uint8_t sensorPins[] = {14};
 uint8_t sensorsPerPin[sizeof(sensorPins)/sizeof(uint8_t)]; // array with number of sensors per pin
 float sensorSamples[MAX_SENSORS]; // the samples coming of the actual sensors
+float reportedSamples[MAX_SENSORS]; // the samples last posted to the endpoint, NAN if never posted
 DeviceAddress sensorAddresses[MAX_SENSORS]; // if using DS18B20 we need the address of each sensor
 char sensorIds[MAX_SENSORS][36];
 
+// DS18B20 bus objects are kept alive so conversions can run while loop() continues
+OneWire oneWireBuses[sizeof(sensorPins)/sizeof(uint8_t)];
+DallasTemperature ds18b20Buses[sizeof(sensorPins)/sizeof(uint8_t)];
+bool ds18b20ConversionPending = false;
+bool ds18b20RescanNeeded = true;
+unsigned long lastDS18B20Scan = 0L;
+unsigned long ds18b20ConversionStarted = 0L;
+unsigned long ds18b20ConversionWait = 0L;
+uint8_t sensorResolutions[MAX_SENSORS]; // resolution in bits applied to each DS18B20 sensor
+
+// DHT22 driver is kept alive and caches the last good reading
+DHT dht(sensorPins[0], DHT_TYPE);
+unsigned long lastDHT22Read = 0L;
+uint32_t dht22Reads = 0;
+uint32_t dht22FailedReads = 0;
+
 bool isSensorTypeDS18B20() {
   return strcmp(configuration.sensorType, "DS18B20") == 0;
 }
@@ -94,9 +245,62 @@ bool isSensorTypeBINARY() {
   return strcmp(configuration.sensorType, "BINARY") == 0;
 }
 
+/**
+ * DS18B20 resolution used for sensors without a resolution of their own. 
+ * Unless configured it's the lowest resolution that still covers 
+ * TEMP_DECIMALS (9 bits = 0.5C in 94ms, 10 bits = 0.25C in 188ms, 
+ * 12 bits = 0.0625C in 750ms).
+ */
+uint8_t getDefaultResolution_DS18B20() {
+  if (configuration.resolution >= 9 && configuration.resolution <= 12) return configuration.resolution;
+  if (TEMP_DECIMALS == 0) return 9;
+  if (TEMP_DECIMALS == 1) return 10;
+  return 12;
+}
+
+/**
+ * Returns the index of the resolution override for the supplied address or 
+ * -1 if there is none.
+ */
+int8_t findResolutionOverride_DS18B20(const uint8_t* address, const Configuration& config = configuration) {
+  for (uint8_t i=0; i<MAX_SENSORS; i++) {
+    if (config.resolutions[i] != 0 && memcmp(config.resolutionAddresses[i], address, sizeof(DeviceAddress)) == 0) return i;
+  }
+  return -1;
+}
+
+/**
+ * DS18B20 resolution to use for the sensor with the supplied address.
+ */
+uint8_t getResolution_DS18B20(const uint8_t* address) {
+  int8_t idx = findResolutionOverride_DS18B20(address);
+  return idx < 0 ? getDefaultResolution_DS18B20() : configuration.resolutions[idx];
+}
+
+/**
+ * Set (resolution 9-12) or clear (resolution 0) the resolution override for 
+ * a DS18B20 sensor. Returns false if there is no room for another override.
+ */
+bool setResolutionOverride_DS18B20(const uint8_t* address, uint8_t resolution, Configuration& config = configuration) {
+  int8_t idx = findResolutionOverride_DS18B20(address, config);
+  if (idx < 0) {
+    if (resolution == 0) return true;
+    for (uint8_t i=0; i<MAX_SENSORS && idx < 0; i++) {
+      if (config.resolutions[i] == 0) idx = i;
+    }
+    if (idx < 0) return false;
+  }
+  memcpy(config.resolutionAddresses[idx], address, sizeof(DeviceAddress));
+  config.resolutions[idx] = resolution;
+  return true;
+}
+
 float copySensorValueToBuffer(uint8_t idx, char* buffer) {
   
-  if (isSensorTypeBINARY()) {
+  if (isnan(sensorSamples[idx])) {
+      // no valid sample yet
+      strcpy(buffer, "n/a");
+    } else if (isSensorTypeBINARY()) {
       // just use value
       strcpy(buffer, sensorSamples[idx] ? "1" : "0");
     } else {
@@ -105,6 +309,8 @@ float copySensorValueToBuffer(uint8_t idx, char* buffer) {
     }
 }
 
+static_assert(MAX_SENSORS <= 32, "Sensor masks are 32 bits");
+
 uint8_t getSensorCount() {
   uint8_t result = 0;
   for (uint8_t i=0; i<sizeof(sensorsPerPin)/sizeof(uint8_t); i++) {
@@ -113,8 +319,59 @@ uint8_t getSensorCount() {
   return result;
 }
 
-bool hasWebEndpoint() {
-  return strcmp(configuration.endpoint, "") != 0;
+bool isMqtt() {
+  return configuration.transport == TRANSPORT_MQTT;
+}
+
+bool hasEndpoint() {
+  return strcmp(isMqtt() ? configuration.mqttBroker : configuration.endpoint, "") != 0;
+}
+
+bool isEncodingMsgPack() {
+  return configuration.encoding == ENCODING_MSGPACK;
+}
+
+// intervals and batch size set by the endpoint (see applyControl()) - kept 
+// apart from configuration so they are never saved and last until restart
+struct {
+  unsigned long delayPoll = 0L;         // 0 when not set
+  unsigned long delayPost = 0L;         // 0 when not set
+  bool hasBatchSize = false;
+  uint16_t batchSize = 0;
+} controlOverrides;
+
+unsigned long getDelayPoll() {
+  return controlOverrides.delayPoll > 0 ? controlOverrides.delayPoll : configuration.delayPoll;
+}
+
+unsigned long getDelayPost() {
+  return controlOverrides.delayPost > 0 ? controlOverrides.delayPost : configuration.delayPost;
+}
+
+uint16_t getBatchSize() {
+  return controlOverrides.hasBatchSize ? controlOverrides.batchSize : configuration.batchSize;
+}
+
+bool isBatching() {
+  return getBatchSize() > 1;
+}
+
+bool isReportByException() {
+  return configuration.deadband > 0;
+}
+
+/**
+ * Mask of the sensors that moved more than the deadband since last reported.
+ */
+uint32_t getChangedSensors() {
+  uint32_t mask = 0;
+  for (uint8_t i=0, k=getSensorCount(); i<k; i++) {
+    if (isnan(sensorSamples[i])) continue;
+    if (isnan(reportedSamples[i]) || fabsf(sensorSamples[i] - reportedSamples[i]) > configuration.deadband) {
+      mask |= 1UL << i;
+    }
+  }
+  return mask;
 }
 
 /**
@@ -205,447 +462,3072 @@ void printIpAddress() {
 }
 
 
-// *** WEB SERVER
-void webHeader(char* buffer, bool back, const char* title) {
-  strcpy(buffer, "<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"initial-scale=1.0\"><title>SensorCentral</title><link rel=\"stylesheet\" href=\"./styles.css\"></head><body>");
-  if (back) strcat(buffer, "<div class=\"position\"><a href=\"./\">Back</a></div>");
-  strcat(buffer, "<div class=\"position title\">");
-  strcat(buffer, title);
-  strcat(buffer, "</div>");
-}
+// ******************** HISTORY
+// ring buffer of sample snapshots kept as struct-of-arrays - one time column 
+// plus one int16 fixed point column per sensor
+#define HISTORY_SLOT_BYTES (sizeof(uint32_t) + MAX_SENSORS * sizeof(int16_t))
+#define HISTORY_SLOTS (HISTORY_MEMORY_BYTES / HISTORY_SLOT_BYTES)
+static_assert(HISTORY_SLOTS >= 60, "HISTORY_MEMORY_BYTES too small for MAX_SENSORS - need room for at least 60 snapshots");
+static_assert(HISTORY_SLOTS <= 65535, "HISTORY_MEMORY_BYTES too large - slots are indexed by uint16_t");
 
-void webRestarting(char* buffer) {
-  webHeader(buffer, false, "Restarting");
-  strcat(buffer, "</body></html>");
-}
+uint32_t historyTimes[HISTORY_SLOTS];                // seconds since boot
+int16_t historyValues[MAX_SENSORS][HISTORY_SLOTS];   // value * HISTORY_SCALE
+uint16_t historyHead = 0;                            // next slot to write
+uint16_t historyCount = 0;                           // number of slots in use
+uint32_t historySeq = 0;                             // number of snapshots ever written
 
-void webHandle_GetRoot() {
-  char response[1024];
-  webHeader(response, false, "Menu");
-  strcat(response, "<div class=\"position menuitem height30\"><a href=\"./data.html\">Data</a></div><div class=\"position menuitem height30\"><a href=\"./sensorconfig.html\">Device/Sensor Config.</a></div><div class=\"position menuitem height30\"><a href=\"./wificonfig.html\">Wi-Fi Config.</a></div><div class=\"position menuitem height30\"><a href=\"./httpstatus.html\">HTTP status</a></div>");
-  strcat(response, "<div class=\"position footer right\">");
-  strcat(response, VERSION_NUMBER);
-  strcat(response, "<br/>");
-  strcat(response, VERSION_LASTCHANGE);
-  strcat(response, "</div>");
-  strcat(response, "</body></html>");
-  server.send(200, "text/html", response);
+/**
+ * Seconds since boot - unlike millis() this doesn't wrap after 49 days.
+ */
+uint32_t getUptimeSeconds() {
+  static uint32_t lastMillis = 0;
+  static uint32_t wraps = 0;
+  uint32_t now = millis();
+  if (now < lastMillis) wraps++;
+  lastMillis = now;
+  return (uint32_t) ((((uint64_t) wraps << 32) + now) / 1000);
 }
 
-void webHandle_GetHttpStatus() {
-  char str_httpcode[8];
-  sprintf(str_httpcode, "%d", lastHttpResponseCode);
-  
-  char response[600];
-  webHeader(response, true, "HTTP Status");
-  strcat(response, "<div class=\"position menuitem\">");
-  strcat(response, "HTTP Code: "); strcat(response, str_httpcode); strcat(response, "<br/>");
-  strcat(response, "HTTP Response: <br/>"); strcat(response, lastHttpResponse); strcat(response, "<br/>");
-  strcat(response, "</div>");
-  strcat(response, "</body></html>");
-  server.send(200, "text/html", response);
+/**
+ * Returns true once the wall clock has been set from NTP.
+ */
+bool isTimeSet() {
+  return time(nullptr) > 1600000000;
 }
 
+void historyClear() {
+  historyHead = 0;
+  historyCount = 0;
+}
 
+/**
+ * Forget the history of a single sensor - used when another sensor takes 
+ * over its index. The other columns and the time column are left alone.
+ */
+void historyClearSensor(uint8_t sensor) {
+  for (uint16_t i=0; i<HISTORY_SLOTS; i++) historyValues[sensor][i] = HISTORY_NO_VALUE;
+}
 
-void webHandle_GetData() {
-  char str_temp[8];
+/**
+ * Append the current sensorSamples to the history, overwriting the oldest 
+ * snapshot when full.
+ */
+void historyAppend() {
   uint8_t sensorCount = getSensorCount();
-  
-  char response[400 + sensorCount * 100];
-  webHeader(response, true, "Data");
-  strcat(response, "<div class=\"position menuitem\">");
-
-  if (isSensorTypeDS18B20()) {
-    if (sensorCount > 0) {
-      for (uint8_t i=0; i<sensorCount; i++) {
-        copySensorValueToBuffer(i, str_temp);
-        strcat(response, sensorIds[i]);
-        strcat(response, ": ");
-        strcat(response, str_temp);
-        strcat(response, "<br/>");
-      }
+  historyTimes[historyHead] = getUptimeSeconds();
+  for (uint8_t i=0; i<MAX_SENSORS; i++) {
+    float scaled = sensorSamples[i] * HISTORY_SCALE;
+    if (i >= sensorCount || isnan(scaled) || scaled <= INT16_MIN || scaled > INT16_MAX) {
+      historyValues[i][historyHead] = HISTORY_NO_VALUE;
     } else {
-      strcat(response, "No DS18B20 sensors found on bus");
+      historyValues[i][historyHead] = (int16_t) lroundf(scaled);
     }
-  } else if (isSensorTypeDHT22()) {
-    strcat(response, "Temperature: ");
-    copySensorValueToBuffer(0, str_temp);
-    strcat(response, str_temp);
-    strcat(response, "&deg;C<br/>Humidity: ");
-    copySensorValueToBuffer(1, str_temp);
-    strcat(response, str_temp);
-    strcat(response, "%");
-  } else if (isSensorTypeBINARY()) {
-    strcat(response, "Binary sensor: ON");
   }
+  historyHead = (historyHead + 1) % HISTORY_SLOTS;
+  if (historyCount < HISTORY_SLOTS) historyCount++;
+  historySeq++;
+}
 
-  strcat(response, "</div></body></html>");
-  server.send(200, "text/html", response);
+/**
+ * Sequence number of the oldest snapshot still in the history. Snapshots are 
+ * numbered from 1 and historySeq is the newest.
+ */
+uint32_t historyOldestSeq() {
+  return historySeq - historyCount + 1;
 }
 
-void webHandle_GetSensorConfig() {
-  char str_deviceid[36];
-  getMacAddressString(str_deviceid);
-  char str_delay_print[12];
-  sprintf(str_delay_print, "%lu", configuration.delayPrint);
-  char str_delay_poll[12];
-  sprintf(str_delay_poll, "%lu", configuration.delayPoll);
-  char str_delay_post[12];
-  sprintf(str_delay_post, "%lu", configuration.delayPost);
-
-  // create buffer
-  char response[2048];
-
-  // show current response
-  webHeader(response, true, "Device/Sensor Config.");
-  strcat(response, "<div class=\"position menuitem\">");
-  strcat(response, "<p>");
-  strcat(response, "Device ID: "); strcat(response, str_deviceid); strcat(response, "<br/>");
-  strcat(response, "Current delay print: "); strcat(response, str_delay_print); strcat(response, "ms<br/>");
-  strcat(response, "Current delay poll: "); strcat(response, str_delay_poll); strcat(response, "ms<br/>");
-  strcat(response, "Current delay post: "); strcat(response, str_delay_post);  strcat(response, "ms<br/>");
-  strcat(response, "Current endpoint: "); 
-  if (strcmp(configuration.endpoint, "") == 0) {
-    strcat(response, "&lt;none configured&gt;"); 
-  } else {
-    strcat(response, configuration.endpoint); 
+/**
+ * Returns the slot holding the snapshot with the supplied sequence number or 
+ * -1 if it's no longer (or not yet) in the history.
+ */
+int32_t historySlot(uint32_t seq) {
+  if (historyCount == 0 || seq < historyOldestSeq() || seq > historySeq) return -1;
+  return (historyHead + HISTORY_SLOTS - (historySeq - seq) - 1) % HISTORY_SLOTS;
+}
+
+bool historyHasValue(uint16_t slot, uint8_t sensor) {
+  return historyValues[sensor][slot] != HISTORY_NO_VALUE;
+}
+
+float historyValue(uint16_t slot, uint8_t sensor) {
+  return (float) historyValues[sensor][slot] / HISTORY_SCALE;
+}
+
+
+// ******************** AGGREGATES
+// running statistics per sensor since the last post, updated incrementally 
+// using Welford's algorithm so memory use doesn't depend on the post interval
+struct SensorAggregate {
+  uint16_t count;
+  float min;
+  float max;
+  float mean;
+  float m2;         // sum of squared differences from the mean
+};
+SensorAggregate sensorAggregates[MAX_SENSORS];
+
+/**
+ * Start a new aggregation window for the sensors with their bit set in 
+ * sensorMask - sensors left out of a post keep aggregating until reported.
+ */
+void aggregateReset(uint32_t sensorMask = ALL_SENSORS) {
+  for (uint8_t i=0; i<MAX_SENSORS; i++) {
+    if (sensorMask & (1UL << i)) memset(&sensorAggregates[i], 0, sizeof(SensorAggregate));
   }
-  strcat(response, "<br/>");
-  strcat(response, "Current JWT: "); 
-  if (strcmp(configuration.jwt, "") == 0) {
-    strcat(response, "&lt;none configured&gt;"); 
-  } else {
-    strncat(response, configuration.jwt, 15); 
-    strcat(response, "..."); 
+}
+
+void aggregateAdd(uint8_t idx, float value) {
+  if (isnan(value)) return;
+  SensorAggregate& agg = sensorAggregates[idx];
+  if (agg.count == UINT16_MAX) return;
+  if (agg.count == 0 || value < agg.min) agg.min = value;
+  if (agg.count == 0 || value > agg.max) agg.max = value;
+  agg.count++;
+  float delta = value - agg.mean;
+  agg.mean += delta / agg.count;
+  agg.m2 += delta * (value - agg.mean);
+}
+
+/**
+ * Sample standard deviation of the values added since the last reset.
+ */
+float aggregateStddev(const SensorAggregate& agg) {
+  return agg.count > 1 ? sqrtf(agg.m2 / (agg.count - 1)) : 0;
+}
+
+
+// ******************** FILTER
+// raw samples pass through a per-sensor filter before ending up in 
+// sensorSamples - known error values are dropped, isolated spikes are 
+// rejected and the result is the median of the last FILTER_WINDOW samples
+struct SensorFilter {
+  float window[FILTER_WINDOW];
+  uint8_t count;          // samples in window
+  uint8_t next;           // next slot to write in window
+  uint8_t spikes;         // consecutive spikes seen
+};
+SensorFilter sensorFilters[MAX_SENSORS];
+
+struct SensorErrors {
+  uint32_t readErrors;    // failed reads and sensor error values
+  uint32_t spikes;        // samples rejected as spikes
+};
+SensorErrors sensorErrors[MAX_SENSORS];
+
+// how the last read of each sensor went - reported as quality flags
+#define SAMPLE_OK 0
+#define SAMPLE_READ_ERROR 1
+#define SAMPLE_SPIKE 2
+#define SAMPLE_STALE_POLLS 3        // a sample older than this many poll delays is stale
+struct SensorQuality {
+  unsigned long sampledAt;  // millis() of the last accepted sample, 0 if none
+  uint8_t lastRead;         // SAMPLE_OK, SAMPLE_READ_ERROR or SAMPLE_SPIKE
+};
+SensorQuality sensorQuality[MAX_SENSORS];
+
+void filterReset(uint8_t idx) {
+  memset(&sensorFilters[idx], 0, sizeof(SensorFilter));
+  sensorSamples[idx] = NAN;
+}
+
+/**
+ * Returns true if the raw value is an error code rather than a measurement - 
+ * NaN from the DHT22, -127 (disconnected) and 85 (power-on reset value) from 
+ * the DS18B20.
+ */
+bool isSensorErrorValue(float value) {
+  if (isnan(value)) return true;
+  if (isSensorTypeDS18B20()) return value == DEVICE_DISCONNECTED_C || value == 85.0;
+  return false;
+}
+
+float filterMedian(const SensorFilter& filter) {
+  float sorted[FILTER_WINDOW];
+  memcpy(sorted, filter.window, filter.count * sizeof(float));
+  for (uint8_t i=1; i<filter.count; i++) {
+    float v = sorted[i];
+    int8_t j = i - 1;
+    while (j >= 0 && sorted[j] > v) {
+      sorted[j + 1] = sorted[j];
+      j--;
+    }
+    sorted[j + 1] = v;
   }
-  strcat(response, "<br/>");
-  strcat(response, "Current sensor type: "); strcat(response, configuration.sensorType);  strcat(response, "<br/>");
-  strcat(response, "</p>");
+  return sorted[filter.count / 2];
+}
 
-  // add form
-  strcat(response, "<form method=\"post\" action=\"/sensor\">");
-  strcat(response, "<table border=\"0\">");
-  strcat(response, "<tr><td align=\"left\">Delay, print</td><td><input type=\"text\" name=\"print\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Delay, poll</td><td><input type=\"text\" name=\"poll\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Delay, post</td><td><input type=\"text\" name=\"post\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Endpoint</td><td><input type=\"text\" name=\"endpoint\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">JWT</td><td><input type=\"text\" name=\"jwt\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Sensor type</td><td><select name=\"sensortype\"><option>DS18B20</option><option>DHT22</option><option>BINARY</option></select></td></tr>");
-  strcat(response, "<tr><td colspan=\"2\" align=\"right\"><input type=\"submit\"></input></td></tr>");
-  strcat(response, "</table>");
+/**
+ * Filter a raw value read from a sensor and store the result in 
+ * sensorSamples. Returns false if the value was rejected. A value jumping 
+ * more than FILTER_SPIKE_LIMIT is only accepted once it persists for more 
+ * than half the window in which case the filter starts over from it.
+ */
+bool storeSample(uint8_t idx, float value) {
+  if (isSensorErrorValue(value)) {
+    sensorErrors[idx].readErrors++;
+    sensorQuality[idx].lastRead = SAMPLE_READ_ERROR;
+    return false;
+  }
 
-  // close page
-  strcat(response, "</div></body></html>");
-  server.send(200, "text/html", response);
+  SensorFilter& filter = sensorFilters[idx];
+  if (filter.count > 0 && fabsf(value - sensorSamples[idx]) > FILTER_SPIKE_LIMIT) {
+    if (++filter.spikes <= FILTER_WINDOW / 2) {
+      sensorErrors[idx].spikes++;
+      sensorQuality[idx].lastRead = SAMPLE_SPIKE;
+      return false;
+    }
+    filterReset(idx);
+  }
+  filter.spikes = 0;
+  filter.window[filter.next] = value;
+  filter.next = (filter.next + 1) % FILTER_WINDOW;
+  if (filter.count < FILTER_WINDOW) filter.count++;
+  sensorSamples[idx] = filterMedian(filter);
+  sensorQuality[idx].sampledAt = millis();
+  sensorQuality[idx].lastRead = SAMPLE_OK;
+  return true;
 }
 
-void webHandle_PostSensorForm() {
-  bool didUpdate = false;
-  Serial.println("Received POST for sensor config");
 
-  if (server.arg("print").length() > 0) {
-    unsigned long larg = atol(server.arg("print").c_str());
-    if (larg != 0) {
-      configuration.delayPrint = larg;
-      didUpdate = true;
-      Serial.print("Delay print: ");
-      Serial.println(larg);
+// ******************** PAYLOAD
+// payloads are never held in memory - writePayload() serializes straight to 
+// a Print (network client, queue file) and is run once to measure the 
+// Content-Length and then once per piece sent. Everything it reads that may 
+// change while a post is in flight is copied into payload when prepared.
+#define PAYLOAD_CONTROL 0               // restart message
+#define PAYLOAD_DATA 1                  // latest sample of the sensors in sensorMask
+#define PAYLOAD_BATCH 2                 // count history snapshots from firstSeq
+#define PAYLOAD_QUEUED 3                // payload of queuedLength bytes replayed from the queue
+#define MAX_PAYLOAD_BYTES (QUEUE_SEGMENT_BYTES - sizeof(uint16_t))
+static_assert(MAX_PAYLOAD_BYTES <= 0x7FFF, "Queue record lengths are 15 bits");
+
+// the payload to post next
+struct Payload {
+  uint8_t type = PAYLOAD_DATA;
+  uint32_t sensorMask = ALL_SENSORS;
+  uint32_t firstSeq = 0;
+  uint16_t count = 0;
+  uint32_t uptime = 0;                  // seconds since boot when prepared
+  uint32_t epoch = 0;                   // seconds since epoch when prepared, 0 if not known
+  uint16_t samples = 0;                 // number of sensor values in the payload
+  size_t queuedLength = 0;
+  uint8_t queuedEncoding = ENCODING_JSON;
+  uint8_t encoding = ENCODING_JSON;     // configuration when prepared
+  bool deltaEncoding = false;
+  bool aggregates = false;
+  uint8_t sensorCount = 0;              // sensors and their state when prepared
+  char ip[16] = "";
+  char ids[MAX_SENSORS][sizeof(sensorIds[0])];
+  float values[MAX_SENSORS];
+  SensorErrors errors[MAX_SENSORS];
+  SensorAggregate stats[MAX_SENSORS];
+  bool details = false;                 // all sensors with age and quality flags (local API)
+  uint32_t ages[MAX_SENSORS];           // seconds since the sample was taken
+  uint8_t lastRead[MAX_SENSORS];
+} payload;
+
+// bytes posted against the number of sensor values in them
+uint32_t postedBytes = 0;
+uint32_t postedSamples = 0;
+
+// post outcomes by response code class and total duration for /metrics
+#define POST_CODE_CLASSES 6             // no response (connect failed, timeout) and 1xx - 5xx
+struct {
+  uint32_t count[POST_CODE_CLASSES];
+  uint32_t durationMillis = 0;          // sum over all posts
+} postStats;
+
+/**
+ * Print implementation only counting the bytes written.
+ */
+class CountingPrint : public Print {
+public:
+  size_t count = 0;
+
+  size_t write(uint8_t c) override {
+    count++;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    count += size;
+    return size;
+  }
+};
+
+/**
+ * Print implementation passing on only length bytes starting at offset of 
+ * what is written to it - used to send a piece of a regenerated payload.
+ */
+class WindowPrint : public Print {
+  Print& target;
+  size_t skip;
+  size_t length;
+
+public:
+  WindowPrint(Print& target, size_t offset, size_t length) : target(target), skip(offset), length(length) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t count = size;
+    if (skip >= count) {
+      skip -= count;
+      return size;
     }
+    data += skip;
+    count -= skip;
+    skip = 0;
+    if (count > length) count = length;
+    if (count > 0) target.write(data, count);
+    length -= count;
+    return size;
+  }
+};
+
+/**
+ * Print implementation collecting writes in a small buffer before passing 
+ * them on so the network sees a few large writes instead of many small ones. 
+ * Remember to flush() when done and check failed.
+ */
+class BufferedPrint : public Print {
+  Print& target;
+  uint8_t buffer[WEB_CHUNK_SIZE];
+  size_t length = 0;
+
+public:
+  bool failed = false;
+
+  BufferedPrint(Print& target) : target(target) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
   }
-  if (server.arg("poll").length() > 0) {
-    unsigned long larg = atol(server.arg("poll").c_str());
-    if (larg != 0) {
-      configuration.delayPoll = larg;
-      didUpdate = true;
-      Serial.print("Delay poll: ");
-      Serial.println(larg);
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t written = 0;
+    while (written < size) {
+      if (length == sizeof(buffer)) flush();
+      size_t count = min(size - written, sizeof(buffer) - length);
+      memcpy(buffer + length, data + written, count);
+      length += count;
+      written += count;
     }
+    return written;
+  }
+
+  void flush() override {
+    if (length == 0) return;
+    if (target.write(buffer, length) != length) failed = true;
+    length = 0;
   }
-  if (server.arg("post").length() > 0) {
-    unsigned long larg = atol(server.arg("post").c_str());
-    if (larg != 0) {
-      configuration.delayPost = larg;
-      didUpdate = true;
-      Serial.print("Delay post: ");
-      Serial.println(larg);
+};
+
+/**
+ * Streaming writer for the payload encodings. Objects and arrays are given 
+ * their number of members up front as MessagePack needs them.
+ */
+class PayloadWriter {
+public:
+  virtual ~PayloadWriter() {}
+  virtual void beginObject(uint16_t size) = 0;
+  virtual void endObject() = 0;
+  virtual void beginArray(uint16_t size) = 0;
+  virtual void endArray() = 0;
+  virtual void key(const char* name) = 0;
+  virtual void value(const char* str) = 0;
+  virtual void value(bool b) = 0;
+  virtual void value(int32_t l) = 0;
+  virtual void value(uint32_t l) = 0;
+  virtual void value(float f) = 0;
+  virtual void null() = 0;
+};
+
+/**
+ * Minimal streaming JSON writer - commas and nesting are tracked with one bit 
+ * per level so it needs no buffer whatever the size of the document.
+ */
+class JsonWriter : public PayloadWriter {
+  Print& out;
+  uint32_t levels = 0;                  // bit 0 set when the current level has a value
+  bool afterKey = false;
+
+  void prefix() {
+    if (afterKey) {
+      afterKey = false;
+      return;
     }
+    if (levels & 1) out.write(',');
+    levels |= 1;
   }
-  if (server.arg("endpoint").length() > 0) {
-    strcpy(configuration.endpoint, server.arg("endpoint").c_str());
-    didUpdate = true;
-    Serial.print("Endpoint: ");
-    Serial.println(configuration.endpoint);
+
+  void string(const char* str) {
+    out.write('"');
+    for (const char* c=str; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        out.write('\\');
+        out.write(*c);
+      } else if ((uint8_t) *c < 0x20) {
+        out.printf_P(PSTR("\\u%04x"), *c);
+      } else {
+        out.write(*c);
+      }
+    }
+    out.write('"');
   }
-  if (server.arg("jwt").length() > 0) {
-    strcpy(configuration.jwt, server.arg("jwt").c_str());
-    didUpdate = true;
-    Serial.print("JWT: ");
-    Serial.println(configuration.jwt);
+
+public:
+  JsonWriter(Print& out) : out(out) {}
+
+  void beginObject(uint16_t size = 0) override { prefix(); out.write('{'); levels <<= 1; }
+  void endObject() override { levels >>= 1; out.write('}'); }
+  void beginArray(uint16_t size = 0) override { prefix(); out.write('['); levels <<= 1; }
+  void endArray() override { levels >>= 1; out.write(']'); }
+  void key(const char* name) override { prefix(); string(name); out.write(':'); afterKey = true; }
+  void value(const char* str) override { prefix(); string(str); }
+  void value(bool b) override { prefix(); out.print(b ? "true" : "false"); }
+  void value(int32_t l) override { prefix(); out.print((long) l); }
+  void value(uint32_t l) override { prefix(); out.print((unsigned long) l); }
+  void null() override { prefix(); out.print("null"); }
+
+  /**
+   * Floats are written with up to 4 decimals and without trailing zeros.
+   */
+  void value(float f) override {
+    if (isnan(f) || isinf(f)) {
+      null();
+      return;
+    }
+    char str[20];
+    dtostrf(f, 1, 4, str);
+    char* end = str + strlen(str) - 1;
+    while (*end == '0') *end-- = '\0';
+    if (*end == '.') *end = '\0';
+    prefix();
+    out.print(str);
   }
-  if (server.arg("sensortype").length() > 0) {
-    strcpy(configuration.sensorType, server.arg("sensortype").c_str());
-    didUpdate = true;
-    Serial.print("Sensor type: ");
-    Serial.println(configuration.sensorType);
+};
+
+/**
+ * Streaming MessagePack writer using the smallest representation for every 
+ * value - small integers (like deltas) take a single byte.
+ */
+class MsgPackWriter : public PayloadWriter {
+  Print& out;
+
+  void header(uint8_t type, uint32_t value, uint8_t bytes) {
+    out.write(type);
+    for (int8_t i=bytes-1; i>=0; i--) {
+      out.write((uint8_t) (value >> (8 * i)));
+    }
   }
 
-  if (didUpdate) {
-    // save to eeprom
-    EEPROM.put(0, configuration);
-    EEPROM.commit();
+  void container(uint8_t fixType, uint8_t type16, uint16_t size) {
+    if (size < 16) {
+      out.write((uint8_t) (fixType | size));
+    } else {
+      header(type16, size, 2);
+    }
+  }
 
-    // send response
-    char response[400];
-    webRestarting(response);
-    server.send(200, "text/html", response);
-    yield();
+public:
+  MsgPackWriter(Print& out) : out(out) {}
 
-    // restart esp
-    ESP.restart();
+  void beginObject(uint16_t size) override { container(0x80, 0xde, size); }
+  void endObject() override {}
+  void beginArray(uint16_t size) override { container(0x90, 0xdc, size); }
+  void endArray() override {}
+  void key(const char* name) override { value(name); }
+  void null() override { out.write((uint8_t) 0xc0); }
+  void value(bool b) override { out.write((uint8_t) (b ? 0xc3 : 0xc2)); }
+
+  void value(const char* str) override {
+    size_t length = strlen(str);
+    if (length < 32) {
+      out.write((uint8_t) (0xa0 | length));
+    } else if (length < 256) {
+      header(0xd9, length, 1);
+    } else {
+      header(0xda, length, 2);
+    }
+    out.write((const uint8_t*) str, length);
   }
-}
 
-void webHandle_GetWifiConfig() {
-  char response[1024];
-  webHeader(response, true, "Wi-Fi Config.");
-  strcat(response, "<div class=\"position menuitem\">");
-  strcat(response, "<p>");
-  strcat(response, "Current SSID: "); strcat(response, wifi_data.ssid); strcat(response, "<br/>");
-  strcat(response, "Current Password: "); strncat(response, wifi_data.password, 4); strcat(response, "****<br/>");
-  strcat(response, "Keep AP on: "); strcat(response, wifi_data.keep_ap_on ? "Yes" : "No"); strcat(response, "<br/>");
-  strcat(response, "Status: "); strcat(response, WiFi.status() == WL_CONNECTED ? "Connected" : "NOT connected");
-  strcat(response, "</p>");
-  strcat(response, "<form method=\"post\" action=\"/wifi\">");
-  strcat(response, "<table border=\"0\">");
-  strcat(response, "<tr><td align=\"left\">SSID</td><td><input type=\"text\" name=\"ssid\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Password</td><td><input type=\"text\" name=\"password\" autocomplete=\"off\"></input></td></tr>");
-  strcat(response, "<tr><td align=\"left\">Keep AP on</td><td><input type=\"checkbox\" name=\"keep_ap_on\" value=\"1\"></input></td></tr>");
-  strcat(response, "<tr><td colspan=\"2\" align=\"right\"><input type=\"submit\"></input></td></tr>");
-  strcat(response, "</table>");
-  strcat(response, "</div></body></html>");
-  server.send(200, "text/html", response);
-}
+  void value(uint32_t l) override {
+    if (l < 128) {
+      out.write((uint8_t) l);
+    } else if (l < 256) {
+      header(0xcc, l, 1);
+    } else if (l < 65536) {
+      header(0xcd, l, 2);
+    } else {
+      header(0xce, l, 4);
+    }
+  }
 
-void webHandle_PostWifiForm() {
-  Serial.println("Received POST with wifi data");
-  if (!server.hasArg("ssid") || !server.hasArg("password") || server.arg("ssid") == NULL || server.arg("password") == NULL) {
-    server.send(417, "text/plain", "417: Invalid Request");
-    return;
+  void value(int32_t l) override {
+    if (l >= 0) {
+      value((uint32_t) l);
+    } else if (l >= -32) {
+      out.write((uint8_t) l);
+    } else if (l >= INT8_MIN) {
+      header(0xd0, (uint8_t) l, 1);
+    } else if (l >= INT16_MIN) {
+      header(0xd1, (uint16_t) l, 2);
+    } else {
+      header(0xd2, (uint32_t) l, 4);
+    }
   }
 
-  // log
-  Serial.print("SSID: ");
-  Serial.println(server.arg("ssid"));
-  Serial.print("Password: ");
-  Serial.println(server.arg("password"));
-  Serial.print("Keep AP on: ");
-  Serial.println(server.arg("keep_ap_on"));
+  void value(float f) override {
+    if (isnan(f) || isinf(f)) {
+      null();
+      return;
+    }
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    header(0xca, bits, 4);
+  }
+};
 
-  // save to eeprom
-  server.arg("ssid").toCharArray(wifi_data.ssid, 32);
-  server.arg("password").toCharArray(wifi_data.password, 20);
-  wifi_data.keep_ap_on = (server.arg("keep_ap_on") && server.arg("keep_ap_on").charAt(0) == '1');
-  EEPROM.put(sizeof configuration, wifi_data);
-  EEPROM.commit();
+uint8_t countSensorsWithErrors(const Payload& p) {
+  uint8_t count = 0;
+  for (uint8_t i=0; i<p.sensorCount; i++) {
+    if (p.errors[i].readErrors > 0 || p.errors[i].spikes > 0) count++;
+  }
+  return count;
+}
+
+/**
+ * Write the device information and error counters shared by all data payloads.
+ */
+void writeDeviceData(PayloadWriter& out, const Payload& p) {
+  uint8_t sensorsWithErrors = countSensorsWithErrors(p);
+  out.key("deviceData");
+  out.beginObject(sensorsWithErrors > 0 ? 3 : 2);
+  out.key("ip"); out.value(p.ip);
+  out.key("uptime"); out.value(p.uptime);
+
+  // error counters for sensors having any
+  if (sensorsWithErrors > 0) {
+    out.key("sensorErrors");
+    out.beginObject(sensorsWithErrors);
+    for (uint8_t i=0; i<p.sensorCount; i++) {
+      if (p.errors[i].readErrors == 0 && p.errors[i].spikes == 0) continue;
+      out.key(p.ids[i]);
+      out.beginObject(2);
+      out.key("read"); out.value(p.errors[i].readErrors);
+      out.key("spike"); out.value(p.errors[i].spikes);
+      out.endObject();
+    }
+    out.endObject();
+  }
+  out.endObject();
+}
 
-  // send response
-  char response[400];
-  webRestarting(response);
-  server.send(200, "text/html", response);
-  delay(200);
+bool isInDataPayload(const Payload& p, uint8_t idx) {
+  if (p.details) return true;
+  return (p.sensorMask & (1UL << idx)) && !isnan(p.values[idx]);
+}
 
-  // restart esp
-  ESP.restart();
+/**
+ * Write the quality flags of a sensor - nodata (never had a valid sample), 
+ * stale (no accepted sample for SAMPLE_STALE_POLLS poll delays), readerror 
+ * or spike (the last read failed or was rejected by the filter).
+ */
+void writeSampleFlags(PayloadWriter& out, const Payload& p, uint8_t idx) {
+  bool nodata = isnan(p.values[idx]);
+  bool stale = !nodata && p.ages[idx] * 1000UL > SAMPLE_STALE_POLLS * getDelayPoll();
+  bool readError = p.lastRead[idx] == SAMPLE_READ_ERROR;
+  bool spike = p.lastRead[idx] == SAMPLE_SPIKE;
+  out.beginArray(nodata + stale + readError + spike);
+  if (nodata) out.value("nodata");
+  if (stale) out.value("stale");
+  if (readError) out.value("readerror");
+  if (spike) out.value("spike");
+  out.endArray();
 }
 
-void webHandle_GetStyles() {
-  char response[500];
-  strcpy(response, "* {font-size: 14pt;}");
-  strcat(response, "a {font-weight: bold;}");
-  strcat(response, "table {margin-left:auto;margin-right:auto;}");
-  strcat(response, ".position {width: 60%; margin-bottom: 10px; position: relative; margin-left: auto; margin-right: auto;}");
-  strcat(response, ".title {text-align: center; font-weight: bold; font-size: 20pt;}");
-  strcat(response, ".right {text-align: right;}");
-  strcat(response, ".footer {font-size: 10pt; font-style: italic;}");
-  strcat(response, ".menuitem {text-align: center; background-color: #efefef; cursor: pointer; border: 1px solid black;}");
-  strcat(response, ".height30 {height: 30px;}");
-  server.send(200, "text/css", response);
+/**
+ * Write the latest value (and aggregates if enabled) of the sensors in 
+ * sensorMask - sensors without a valid sample are left out. With details 
+ * every sensor is written with the age of its sample and quality flags.
+ */
+void writeDataPayload(PayloadWriter& out, const Payload& p) {
+  uint8_t count = 0;
+  for (uint8_t i=0; i<p.sensorCount; i++) {
+    if (isInDataPayload(p, i)) count++;
+  }
+
+  out.key("msgtype"); out.value("data");
+  out.key("data");
+  out.beginArray(count);
+  for (uint8_t i=0; i<p.sensorCount; i++) {
+    if (!isInDataPayload(p, i)) continue;
+    const SensorAggregate& stats = p.stats[i];
+    bool aggregate = p.aggregates && stats.count > 0;
+    out.beginObject((aggregate ? 3 : 2) + (p.details ? 2 : 0));
+    out.key("sensorId"); out.value(p.ids[i]);
+    out.key("sensorValue"); out.value(p.values[i]);
+    if (p.details) {
+      out.key("age");
+      if (isnan(p.values[i])) out.null(); else out.value(p.ages[i]);
+      out.key("flags"); writeSampleFlags(out, p, i);
+    }
+
+    // add statistics since last post
+    if (aggregate) {
+      out.key("aggregate");
+      out.beginObject(5);
+      out.key("count"); out.value((uint32_t) stats.count);
+      out.key("min"); out.value(stats.min);
+      out.key("max"); out.value(stats.max);
+      out.key("mean"); out.value(stats.mean);
+      out.key("stddev"); out.value(aggregateStddev(stats));
+      out.endObject();
+    }
+    out.endObject();
+  }
+  out.endArray();
 }
 
-void webHandle_NotFound(){
-  server.send(404, "text/plain", "404: Not found");
+/**
+ * Write history snapshots as [time, value, ...] with values in sensor order 
+ * as fixed point integers (divide by scale) or null. Time is seconds since 
+ * epoch once NTP has synced or else seconds since boot (timebase tells which).
+ * 
+ * With delta encoding time is the difference to the previous snapshot and 
+ * each value the difference to the previous non-null value of that sensor 
+ * (the first ones being differences to 0).
+ */
+void writeBatchPayload(PayloadWriter& out, const Payload& p) {
+  uint8_t sensorCount = p.sensorCount;
+  uint16_t count = 0;
+  for (uint32_t seq=p.firstSeq; seq<p.firstSeq + p.count; seq++) {
+    if (historySlot(seq) >= 0) count++;
+  }
+
+  out.key("msgtype"); out.value("batch");
+  if (p.deltaEncoding) {
+    out.key("encoding"); out.value("delta");
+  }
+  out.key("timebase"); out.value(p.epoch ? "epoch" : "uptime");
+  out.key("scale"); out.value((int32_t) HISTORY_SCALE);
+  out.key("sensors");
+  out.beginArray(sensorCount);
+  for (uint8_t i=0; i<sensorCount; i++) {
+    out.value(p.ids[i]);
+  }
+  out.endArray();
+
+  out.key("samples");
+  out.beginArray(count);
+  uint32_t previousTime = 0;
+  int16_t previousValues[MAX_SENSORS] = {};
+  for (uint32_t seq=p.firstSeq; seq<p.firstSeq + p.count; seq++) {
+    int32_t slot = historySlot(seq);
+    if (slot < 0) continue;
+    uint32_t time = p.epoch ? p.epoch - (p.uptime - historyTimes[slot]) : historyTimes[slot];
+    out.beginArray(sensorCount + 1);
+    if (p.deltaEncoding) {
+      out.value(time - previousTime);
+      previousTime = time;
+    } else {
+      out.value(time);
+    }
+    for (uint8_t i=0; i<sensorCount; i++) {
+      if (!historyHasValue(slot, i)) {
+        out.null();
+      } else if (p.deltaEncoding) {
+        out.value((int32_t) historyValues[i][slot] - previousValues[i]);
+        previousValues[i] = historyValues[i][slot];
+      } else {
+        out.value((int32_t) historyValues[i][slot]);
+      }
+    }
+    out.endArray();
+  }
+  out.endArray();
+}
+
+/**
+ * Serialize the prepared payload in the configured encoding. Writes exactly 
+ * the same bytes every time it's called for the same payload.
+ */
+void writePayload(Print& print, const Payload& p = payload) {
+  JsonWriter json(print);
+  MsgPackWriter msgpack(print);
+  PayloadWriter& out = p.encoding == ENCODING_MSGPACK ? (PayloadWriter&) msgpack : (PayloadWriter&) json;
+
+  char mac_addr[20];
+  getMacAddressString(mac_addr);
+  if (p.type == PAYLOAD_CONTROL) {
+    out.beginObject(3);
+    out.key("deviceId"); out.value(mac_addr);
+    out.key("msgtype"); out.value("control");
+    out.key("data");
+    out.beginObject(2);
+    out.key("restart"); out.value(true);
+    out.key("ip"); out.value(p.ip);
+    out.endObject();
+  } else if (p.type == PAYLOAD_BATCH) {
+    out.beginObject(p.deltaEncoding ? 8 : 7);
+    out.key("deviceId"); out.value(mac_addr);
+    writeDeviceData(out, p);
+    writeBatchPayload(out, p);
+  } else {
+    out.beginObject(4);
+    out.key("deviceId"); out.value(mac_addr);
+    writeDeviceData(out, p);
+    writeDataPayload(out, p);
+  }
+  out.endObject();
+}
+
+const char* getPayloadContentType() {
+  uint8_t encoding = payload.type == PAYLOAD_QUEUED ? payload.queuedEncoding : payload.encoding;
+  return encoding == ENCODING_MSGPACK ? "application/msgpack" : "application/json";
+}
+
+size_t measurePayload() {
+  CountingPrint counter;
+  writePayload(counter);
+  return counter.count;
+}
+
+void startPayload(uint8_t type, Payload& p = payload) {
+  p.type = type;
+  p.samples = 0;
+  p.uptime = getUptimeSeconds();
+  p.epoch = isTimeSet() ? (uint32_t) time(nullptr) : 0;
+  p.encoding = configuration.encoding;
+  p.deltaEncoding = configuration.deltaEncoding;
+  p.aggregates = configuration.aggregates;
+  p.details = false;
+  p.sensorCount = getSensorCount();
+  getIpAddressString(p.ip);
+  memcpy(p.ids, sensorIds, sizeof(p.ids));
+  memcpy(p.values, sensorSamples, sizeof(p.values));
+  memcpy(p.errors, sensorErrors, sizeof(p.errors));
+  memcpy(p.stats, sensorAggregates, sizeof(p.stats));
+  for (uint8_t i=0; i<p.sensorCount; i++) {
+    p.ages[i] = (millis() - sensorQuality[i].sampledAt) / 1000;
+    p.lastRead[i] = sensorQuality[i].lastRead;
+  }
+}
+
+void prepareControlPayload() {
+  startPayload(PAYLOAD_CONTROL);
+}
+
+/**
+ * Prepare a data payload. Only sensors with their bit set in sensorMask are 
+ * included and their values are remembered as reported.
+ */
+void preparePayload(uint32_t sensorMask = ALL_SENSORS) {
+  startPayload(PAYLOAD_DATA);
+  payload.sensorMask = sensorMask;
+  payload.samples = 0;
+  for (uint8_t i=0; i<payload.sensorCount; i++) {
+    if (!isInDataPayload(payload, i)) continue;
+    reportedSamples[i] = payload.values[i];
+    payload.samples++;
+  }
+}
+
+// ******************** BATCH
+// in batch mode every snapshot in the history is posted - batchPostedSeq is 
+// the newest history snapshot already included in a batch
+uint32_t batchPostedSeq = 0;
+
+uint32_t getBatchFirstSeq() {
+  return max(batchPostedSeq + 1, historyOldestSeq());
+}
+
+uint32_t getBatchPending() {
+  return historySeq >= getBatchFirstSeq() ? historySeq - getBatchFirstSeq() + 1 : 0;
+}
+
+/**
+ * Max number of snapshots in a batch so the payload can still be queued - 
+ * each snapshot is a timestamp plus up to 7 characters per sensor and each 
+ * sensor is in the sensors array and the sensorErrors map by id.
+ */
+uint16_t getMaxBatchSize() {
+  uint8_t sensorCount = getSensorCount();
+  size_t overhead = 256 + sensorCount * (2 * sizeof(sensorIds[0]) + 48);
+  size_t perSnapshot = 14 + sensorCount * 7;
+  return MAX_PAYLOAD_BYTES > overhead ? (MAX_PAYLOAD_BYTES - overhead) / perSnapshot : 1;
+}
+
+/**
+ * A batch is due when batchSize snapshots are waiting or the oldest waiting 
+ * snapshot is older than delayBatch.
+ */
+bool isBatchDue() {
+  uint32_t pending = getBatchPending();
+  if (pending == 0) return false;
+  if (pending >= getBatchSize() || pending >= getMaxBatchSize()) return true;
+  int32_t slot = historySlot(getBatchFirstSeq());
+  return slot >= 0 && (getUptimeSeconds() - historyTimes[slot]) * 1000UL >= configuration.delayBatch;
+}
+
+/**
+ * Prepare a payload with the waiting history snapshots - oldest first, no 
+ * more than getMaxBatchSize() and fewer if the payload measures more than 
+ * MAX_PAYLOAD_BYTES (it couldn't be queued if the post fails).
+ */
+void prepareBatchPayload() {
+  startPayload(PAYLOAD_BATCH);
+  payload.firstSeq = getBatchFirstSeq();
+  payload.count = min((uint32_t) getMaxBatchSize(), min((uint32_t) getBatchSize(), getBatchPending()));
+  for (size_t length = measurePayload(); length > MAX_PAYLOAD_BYTES && payload.count > 1; length = measurePayload()) {
+    payload.count = min((uint32_t) payload.count - 1, (uint32_t) ((uint64_t) payload.count * MAX_PAYLOAD_BYTES / length));
+    if (payload.count == 0) payload.count = 1;
+  }
+  payload.samples = payload.count * getSensorCount();
+  batchPostedSeq = payload.firstSeq + payload.count - 1;
+}
+
+
+// ******************** QUEUE
+// append-only queue of payloads that failed to post, kept in LittleFS so it 
+// survives restarts. Payloads are appended as records (uint16_t length + 
+// payload) to numbered segment files of up to QUEUE_SEGMENT_BYTES. Replayed 
+// records are skipped using a read cursor and a segment file is only removed 
+// once fully replayed or when the oldest has to go to make room - no segment 
+// is ever rewritten. The small cursor file is saved once per replay pass or 
+// when a segment goes, so after a crash up to QUEUE_REPLAY_BATCH payloads 
+// may be posted again.
+#define QUEUE_DIR "/queue"
+#define QUEUE_CURSOR_FILE "/queue/cursor"
+#define QUEUE_MSGPACK_FLAG 0x8000       // set in the record length for MessagePack payloads
+#define QUEUE_LENGTH_MASK 0x7FFF
+
+struct {
+  bool mounted = false;
+  uint32_t firstSegment = 1;     // oldest segment file
+  uint32_t lastSegment = 0;      // newest segment file, less than firstSegment when empty
+  uint32_t readOffset = 0;       // offset of next record to replay in firstSegment
+  uint32_t records = 0;          // queued records
+  uint32_t bytes = 0;            // queued payload bytes
+  uint32_t evicted = 0;          // records dropped to make room or rejected by the endpoint since boot
+  bool cursorDirty = false;      // readOffset moved since the cursor was saved
+} postQueue;
+
+void queueSegmentPath(uint32_t segment, char* buffer) {
+  sprintf(buffer, QUEUE_DIR "/%08lx", (unsigned long) segment);
+}
+
+uint32_t queueSegmentCount() {
+  return postQueue.lastSegment >= postQueue.firstSegment ? postQueue.lastSegment - postQueue.firstSegment + 1 : 0;
+}
+
+void queueSaveCursor() {
+  File f = LittleFS.open(QUEUE_CURSOR_FILE, "w");
+  if (!f) return;
+  f.write((const uint8_t*) &postQueue.firstSegment, sizeof(uint32_t));
+  f.write((const uint8_t*) &postQueue.readOffset, sizeof(uint32_t));
+  f.close();
+  postQueue.cursorDirty = false;
+}
+
+/**
+ * Count the records and payload bytes in a segment from the supplied offset.
+ */
+void queueCountSegment(uint32_t segment, uint32_t offset, uint32_t* records, uint32_t* bytes) {
+  char path[24];
+  queueSegmentPath(segment, path);
+  File f = LittleFS.open(path, "r");
+  if (!f) return;
+  uint16_t length;
+  f.seek(offset, SeekSet);
+  while (f.read((uint8_t*) &length, sizeof(length)) == sizeof(length) && f.position() + (length & QUEUE_LENGTH_MASK) <= f.size()) {
+    length &= QUEUE_LENGTH_MASK;
+    (*records)++;
+    (*bytes) += length;
+    f.seek(length, SeekCur);
+  }
+  f.close();
+}
+
+/**
+ * Mount the file system and find the queued payloads left from before the 
+ * restart.
+ */
+void initQueue() {
+  if (!LittleFS.begin()) {
+    Serial.println("Unable to mount LittleFS - failed posts will not be queued");
+    return;
+  }
+  postQueue.mounted = true;
+  LittleFS.mkdir(QUEUE_DIR);
+
+  // find segment range
+  uint32_t first = UINT32_MAX;
+  uint32_t last = 0;
+  Dir dir = LittleFS.openDir(QUEUE_DIR);
+  while (dir.next()) {
+    if (dir.fileName().equals("cursor")) continue;
+    uint32_t segment = strtoul(dir.fileName().c_str(), NULL, 16);
+    if (segment < first) first = segment;
+    if (segment > last) last = segment;
+  }
+  if (last == 0) {
+    postQueue.firstSegment = 1;
+    postQueue.lastSegment = 0;
+  } else {
+    postQueue.firstSegment = first;
+    postQueue.lastSegment = last;
+  }
+
+  // restore read position
+  File f = LittleFS.open(QUEUE_CURSOR_FILE, "r");
+  if (f) {
+    uint32_t segment = 0;
+    uint32_t offset = 0;
+    f.read((uint8_t*) &segment, sizeof(uint32_t));
+    f.read((uint8_t*) &offset, sizeof(uint32_t));
+    f.close();
+    if (segment == postQueue.firstSegment) postQueue.readOffset = offset;
+  }
+
+  for (uint32_t segment=postQueue.firstSegment; segment<=postQueue.lastSegment; segment++) {
+    queueCountSegment(segment, segment == postQueue.firstSegment ? postQueue.readOffset : 0, &postQueue.records, &postQueue.bytes);
+    yield();
+  }
+  Serial.print("Found <");
+  Serial.print(postQueue.records);
+  Serial.println("> queued payloads");
+}
+
+/**
+ * Remove the oldest segment and everything left in it.
+ */
+void queueDropFirstSegment() {
+  uint32_t records = 0;
+  uint32_t bytes = 0;
+  queueCountSegment(postQueue.firstSegment, postQueue.readOffset, &records, &bytes);
+  char path[24];
+  queueSegmentPath(postQueue.firstSegment, path);
+  LittleFS.remove(path);
+  postQueue.records -= min(records, postQueue.records);
+  postQueue.bytes -= min(bytes, postQueue.bytes);
+  postQueue.firstSegment++;
+  postQueue.readOffset = 0;
+  if (postQueue.lastSegment < postQueue.firstSegment) {
+    // queue is empty - start numbering over
+    postQueue.firstSegment = 1;
+    postQueue.lastSegment = 0;
+  }
+  queueSaveCursor();
+}
+
+/**
+ * Append the prepared payload to the queue, dropping the oldest segment if 
+ * the queue is full.
+ */
+bool queueAppend() {
+  size_t length = measurePayload();
+  if (!postQueue.mounted || length == 0 || length > MAX_PAYLOAD_BYTES) return false;
+
+  // find segment with room for the record
+  char path[24];
+  queueSegmentPath(postQueue.lastSegment, path);
+  if (queueSegmentCount() == 0 || !LittleFS.exists(path) || 
+      LittleFS.open(path, "r").size() + sizeof(uint16_t) + length > QUEUE_SEGMENT_BYTES) {
+    if (queueSegmentCount() >= QUEUE_MAX_SEGMENTS) {
+      uint32_t records = postQueue.records;
+      queueDropFirstSegment();
+      postQueue.evicted += records - postQueue.records;
+      Serial.println("Post queue full - dropped oldest payloads");
+    }
+    postQueue.lastSegment++;
+    queueSegmentPath(postQueue.lastSegment, path);
+  }
+
+  File f = LittleFS.open(path, "a");
+  if (!f) return false;
+  uint16_t recordLength = length | (payload.encoding == ENCODING_MSGPACK ? QUEUE_MSGPACK_FLAG : 0);
+  bool ok = f.write((const uint8_t*) &recordLength, sizeof(uint16_t)) == sizeof(uint16_t);
+  if (ok) {
+    BufferedPrint out(f);
+    writePayload(out);
+    out.flush();
+    ok = !out.failed;
+  }
+  f.close();
+  if (!ok) return false;
+  postQueue.records++;
+  postQueue.bytes += length;
+  return true;
+}
+
+/**
+ * Returns the length of the oldest queued payload without removing it or 0 
+ * if the queue is empty. Its encoding is returned in encoding.
+ */
+size_t queuePeek(uint8_t* encoding) {
+  while (postQueue.mounted && postQueue.records > 0) {
+    char path[24];
+    queueSegmentPath(postQueue.firstSegment, path);
+    File f = LittleFS.open(path, "r");
+    uint16_t length = 0;
+    if (f && f.seek(postQueue.readOffset, SeekSet) && f.read((uint8_t*) &length, sizeof(length)) == sizeof(length) && 
+        (length & QUEUE_LENGTH_MASK) > 0 && f.position() + (length & QUEUE_LENGTH_MASK) <= f.size()) {
+      f.close();
+      *encoding = (length & QUEUE_MSGPACK_FLAG) ? ENCODING_MSGPACK : ENCODING_JSON;
+      return length & QUEUE_LENGTH_MASK;
+    }
+    f.close();
+
+    // segment exhausted or unreadable - move on to the next
+    queueDropFirstSegment();
+  }
+  return 0;
+}
+
+/**
+ * Copy the oldest queued payload of the supplied length to out.
+ */
+void queueCopy(Print& out, size_t length) {
+  char path[24];
+  queueSegmentPath(postQueue.firstSegment, path);
+  File f = LittleFS.open(path, "r");
+  if (!f || !f.seek(postQueue.readOffset + sizeof(uint16_t), SeekSet)) return;
+  uint8_t buffer[64];
+  while (length > 0) {
+    int count = f.read(buffer, min(length, sizeof(buffer)));
+    if (count <= 0) break;
+    out.write(buffer, count);
+    length -= count;
+  }
+  f.close();
+}
+
+/**
+ * Remove the oldest queued payload of the supplied length.
+ */
+void queuePop(size_t length) {
+  postQueue.readOffset += sizeof(uint16_t) + length;
+  postQueue.records--;
+  postQueue.bytes -= min((uint32_t) length, postQueue.bytes);
+  if (postQueue.records == 0) {
+    // remove everything so we start over with an empty segment
+    while (queueSegmentCount() > 0) queueDropFirstSegment();
+  } else {
+    postQueue.cursorDirty = true;
+  }
+}
+
+
+// ******************** BREAKER
+// circuit breaker in front of the endpoint - after BREAKER_FAILURES failed 
+// posts in a row it opens and nothing is posted (payloads go straight to the 
+// queue) until a randomized, exponentially growing delay has passed. Then 
+// a single trial post is let through (half-open) which closes it again on 
+// success or re-opens it with twice the delay on failure.
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+struct {
+  uint8_t state = BREAKER_CLOSED;
+  uint8_t failures = 0;                 // failed posts in a row
+  unsigned long openedAt = 0L;
+  unsigned long delay = 0L;             // time from opening to the trial post, in milliseconds
+} breaker;
+
+/**
+ * Returns true if the status code says the endpoint is unavailable (as 
+ * opposed to rejecting this particular request).
+ */
+bool isEndpointFailure(int code) {
+  return code < 0 || code >= 500 || code == 408 || code == 429;
+}
+
+/**
+ * Returns true if a payload failing with the status code is worth keeping 
+ * to post again - the endpoint was unavailable or refused our credentials 
+ * (which may be fixed). Anything else is rejected for good.
+ */
+bool isRetryable(int code) {
+  return isEndpointFailure(code) || code == 401 || code == 403;
+}
+
+/**
+ * Milliseconds to wait according to a Retry-After header value - either 
+ * delay-seconds or an HTTP-date (only usable once the clock is set). 
+ * Capped at DELAY_BACKOFF_MAX, 0 if not understood.
+ */
+unsigned long parseRetryAfter(const char* value) {
+  while (*value == ' ') value++;
+  unsigned long seconds = 0;
+  if (isdigit(*value)) {
+    seconds = strtoul(value, NULL, 10);
+  } else {
+    // IMF-fixdate like Sun, 06 Nov 1994 08:49:37 GMT
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    struct tm tm = {};
+    if (!isTimeSet() || sscanf(value, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, month, &tm.tm_year, 
+        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || strlen(month) != 3) return 0;
+    const char* found = strstr(months, month);
+    if (!found || (found - months) % 3 != 0) return 0;
+    tm.tm_mon = (found - months) / 3;
+    tm.tm_year -= 1900;
+    time_t at = mktime(&tm);           // clock runs on UTC, see configTime()
+    time_t now = time(nullptr);
+    if (at <= now) return 0;
+    seconds = at - now;
+  }
+  return min(seconds, DELAY_BACKOFF_MAX / 1000) * 1000UL;
+}
+
+/**
+ * Update the breaker with the status code of a post and the Retry-After of 
+ * the response (0 if none). Retry-After opens the breaker right away and is 
+ * waited out in full.
+ */
+void breakerRecord(int code, unsigned long retryAfter) {
+  if (!isEndpointFailure(code)) {
+    if (breaker.state != BREAKER_CLOSED) Serial.println("Circuit breaker closed");
+    breaker.state = BREAKER_CLOSED;
+    breaker.failures = 0;
+    return;
+  }
+  if (breaker.failures < UINT8_MAX) breaker.failures++;
+  if (breaker.state == BREAKER_CLOSED && breaker.failures < BREAKER_FAILURES && retryAfter == 0) return;
+
+  // double the delay for every failure after opening, half of it random so 
+  // devices failing together don't retry together
+  uint8_t doublings = breaker.failures > BREAKER_FAILURES ? min(breaker.failures - BREAKER_FAILURES, 16) : 0;
+  unsigned long delay = min(DELAY_BACKOFF_MIN << doublings, DELAY_BACKOFF_MAX);
+  delay = delay / 2 + random(delay / 2 + 1);
+  if (retryAfter > delay) delay = retryAfter;
+
+  breaker.state = BREAKER_OPEN;
+  breaker.openedAt = millis();
+  breaker.delay = delay;
+  Serial.print("Circuit breaker open for ");
+  Serial.print(delay / 1000);
+  Serial.println("s");
+}
+
+/**
+ * Returns true if a post may be made - moves an open breaker to half-open 
+ * once its delay has passed.
+ */
+bool isBreakerAllowing() {
+  if (breaker.state == BREAKER_OPEN && (millis() - breaker.openedAt) >= breaker.delay) {
+    Serial.println("Circuit breaker half-open - trying endpoint");
+    breaker.state = BREAKER_HALF_OPEN;
+  }
+  return breaker.state != BREAKER_OPEN;
+}
+
+/**
+ * Milliseconds until an open breaker lets a post through, 0 if not open.
+ */
+unsigned long getBreakerWait() {
+  if (breaker.state != BREAKER_OPEN) return 0;
+  unsigned long elapsed = millis() - breaker.openedAt;
+  return elapsed < breaker.delay ? breaker.delay - elapsed : 0;
+}
+
+const char* getBreakerStateString() {
+  if (breaker.state == BREAKER_OPEN) return "open";
+  if (breaker.state == BREAKER_HALF_OPEN) return "half-open";
+  return "closed";
+}
+
+
+// ******************** CONTROL
+// the endpoint may steer the device by answering a post with a JSON body 
+// holding a control object, e.g. 
+//   {"control": {"delayPoll": 30000, "delayPost": 300000, "batchSize": 10, "pauseFor": 600}}
+// Intervals are in milliseconds, pauseFor in seconds and pauseUntil in 
+// seconds since epoch. Changes apply right away and last until restart. 
+// While paused nothing is posted - payloads go to the queue.
+struct {
+  unsigned long pausedAt = 0L;
+  unsigned long duration = 0L;          // 0 when not paused, in milliseconds
+} postPause;
+
+bool isPostPaused() {
+  if (postPause.duration > 0 && (millis() - postPause.pausedAt) >= postPause.duration) {
+    Serial.println("Pause requested by endpoint is over");
+    postPause.duration = 0L;
+  }
+  return postPause.duration > 0;
+}
+
+/**
+ * Milliseconds until posting resumes, 0 if not paused.
+ */
+unsigned long getPauseRemaining() {
+  if (!isPostPaused()) return 0;
+  return postPause.duration - (millis() - postPause.pausedAt);
+}
+
+void pausePosting(unsigned long duration) {
+  postPause.pausedAt = millis();
+  postPause.duration = min(duration, MAX_CONTROL_PAUSE);
+  if (postPause.duration == 0) {
+    Serial.println("Endpoint resumed posting");
+    return;
+  }
+  Serial.print("Endpoint paused posting for ");
+  Serial.print(postPause.duration / 1000);
+  Serial.println("s");
+}
+
+/**
+ * Apply the control object in the body of the last response if there is one. 
+ * Only the kept prefix of the body is looked at so the control object has to 
+ * fit in HTTP_RESPONSE_PREFIX bytes. Values out of range are ignored.
+ */
+void applyControl() {
+  if (lastHttpResponse[0] != '{') return;
+  StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+  filter["control"] = true;
+  StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(5) + 64> doc;      // + copies of the keys
+  if (deserializeJson(doc, (const char*) lastHttpResponse, DeserializationOption::Filter(filter))) return;
+  JsonObject control = doc["control"];
+  if (control.isNull()) return;
+
+  unsigned long delayPoll = control["delayPoll"] | 0UL;
+  if (delayPoll >= MIN_CONTROL_DELAY && delayPoll != getDelayPoll()) {
+    Serial.print("Endpoint set poll delay to "); Serial.println(delayPoll);
+    controlOverrides.delayPoll = delayPoll;
+  }
+  unsigned long delayPost = control["delayPost"] | 0UL;
+  if (delayPost >= MIN_CONTROL_DELAY && delayPost != getDelayPost()) {
+    Serial.print("Endpoint set post delay to "); Serial.println(delayPost);
+    controlOverrides.delayPost = delayPost;
+  }
+  if (control.containsKey("batchSize")) {
+    uint16_t batchSize = min(control["batchSize"] | 0UL, (unsigned long) getMaxBatchSize());
+    if (batchSize != getBatchSize()) {
+      Serial.print("Endpoint set batch size to "); Serial.println(batchSize);
+      controlOverrides.batchSize = batchSize;
+      controlOverrides.hasBatchSize = true;
+    }
+  }
+
+  // pause - 0 seconds or a time in the past resumes, seconds are capped 
+  // before converting so a huge value can't wrap into a short pause
+  if (control.containsKey("pauseFor")) {
+    unsigned long seconds = control["pauseFor"] | 0UL;
+    pausePosting(min(seconds, MAX_CONTROL_PAUSE / 1000) * 1000UL);
+  } else if (control.containsKey("pauseUntil") && isTimeSet()) {
+    uint32_t until = control["pauseUntil"] | 0UL;
+    uint32_t now = (uint32_t) time(nullptr);
+    unsigned long seconds = until > now ? until - now : 0;
+    pausePosting(min(seconds, MAX_CONTROL_PAUSE / 1000) * 1000UL);
+  }
+}
+
+
+// *** WEB SERVER
+// pages are streamed - fixed template parts come from flash with F() / PSTR() 
+// and dynamic values are written as they are rendered, so a page needs no 
+// more than the WEB_CHUNK_SIZE buffer of ChunkedResponse whatever its size
+/**
+ * Print implementation streaming a response to the client as chunks of 
+ * WEB_CHUNK_SIZE bytes. Call end() once the response is written.
+ */
+class ChunkedResponse : public Print {
+  char buffer[WEB_CHUNK_SIZE];
+  size_t length = 0;
+
+public:
+  ChunkedResponse(int code, const char* contentType) {
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(code, contentType, "");
+  }
+
+  size_t write(uint8_t c) override {
+    if (length == sizeof(buffer)) flush();
+    buffer[length++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t written = 0;
+    while (written < size) {
+      if (length == sizeof(buffer)) flush();
+      size_t count = min(size - written, sizeof(buffer) - length);
+      memcpy(buffer + length, data + written, count);
+      length += count;
+      written += count;
+    }
+    return written;
+  }
+
+  /**
+   * Write text from memory (configuration, sensor ids, responses) with the 
+   * characters special to HTML escaped.
+   */
+  void escaped(const char* str) {
+    for (const char* c=str; *c; c++) {
+      switch (*c) {
+        case '<': print(F("&lt;")); break;
+        case '>': print(F("&gt;")); break;
+        case '&': print(F("&amp;")); break;
+        case '"': print(F("&quot;")); break;
+        default: write((uint8_t) *c);
+      }
+    }
+  }
+
+  void flush() override {
+    if (length == 0) return;
+    server.sendContent(buffer, length);
+    length = 0;
+  }
+
+  void end() {
+    flush();
+    server.sendContent("");
+  }
+};
+
+void webHeader(ChunkedResponse& out, bool back, const __FlashStringHelper* title) {
+  out.print(F("<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"initial-scale=1.0\"><title>SensorCentral</title><link rel=\"stylesheet\" href=\"./styles.css?v=" ASSET_STYLES_VERSION "\"></head><body>"));
+  if (back) out.print(F("<div class=\"position\"><a href=\"./\">Back</a></div>"));
+  out.print(F("<div class=\"position title\">"));
+  out.print(title);
+  out.print(F("</div>"));
+}
+
+void webFooter(ChunkedResponse& out) {
+  out.print(F("</body></html>"));
+  out.end();
+}
+
+void webSaved(bool didUpdate) {
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, true, didUpdate ? F("Saved") : F("No changes"));
+  webFooter(out);
+}
+
+/**
+ * Write a row of a form table with a text input.
+ */
+void webFormInput(ChunkedResponse& out, const __FlashStringHelper* label, const char* name, const char* type = "text") {
+  out.print(F("<tr><td align=\"left\">"));
+  out.print(label);
+  out.printf_P(PSTR("</td><td><input type=\"%s\" name=\"%s\" autocomplete=\"off\"></input></td></tr>"), type, name);
+}
+
+void webFormCheckbox(ChunkedResponse& out, const __FlashStringHelper* label, const char* name, bool checked) {
+  out.print(F("<tr><td align=\"left\">"));
+  out.print(label);
+  out.printf_P(PSTR("</td><td><input type=\"checkbox\" name=\"%s\" value=\"1\"%s></input></td></tr>"), name, checked ? " checked" : "");
+}
+
+void webHandle_GetRoot() {
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, false, F("Menu"));
+  out.print(F("<div class=\"position menuitem height30\"><a href=\"./data.html\">Data</a></div><div class=\"position menuitem height30\"><a href=\"./sensorconfig.html\">Device/Sensor Config.</a></div><div class=\"position menuitem height30\"><a href=\"./wificonfig.html\">Wi-Fi Config.</a></div><div class=\"position menuitem height30\"><a href=\"./httpstatus.html\">HTTP status</a></div>"));
+  out.print(F("<div class=\"position footer right\">"));
+  out.print(F(VERSION_NUMBER));
+  out.print(F("<br/>"));
+  out.print(F(VERSION_LASTCHANGE));
+  out.print(F("</div>"));
+  webFooter(out);
+}
+
+void webHandle_GetHttpStatus() {
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, true, F("HTTP Status"));
+  out.print(F("<div class=\"position menuitem\">"));
+  out.printf_P(PSTR("HTTP Code: %d<br/>"), lastHttpResponseCode);
+  out.printf_P(PSTR("Duration: %lums (%s connection)<br/>"), lastHttpDuration, lastHttpReused ? "reused" : "new");
+  if (isPosting()) out.print(F("Post in progress<br/>"));
+  out.printf_P(PSTR("Circuit breaker: %s (%u failures in a row)<br/>"), getBreakerStateString(), breaker.failures);
+  if (breaker.state == BREAKER_OPEN) {
+    out.printf_P(PSTR("Next attempt in: %lus<br/>"), getBreakerWait() / 1000);
+  }
+  if (isPostPaused()) {
+    out.printf_P(PSTR("Paused by endpoint for: %lus<br/>"), getPauseRemaining() / 1000);
+  }
+  out.printf_P(PSTR("Queued payloads: %lu (%lu bytes, %lu dropped)<br/>"), 
+    (unsigned long) postQueue.records, (unsigned long) postQueue.bytes, (unsigned long) postQueue.evicted);
+  if (postedSamples > 0) {
+    out.print(F("Bytes sent per sample: "));
+    out.print((float) postedBytes / postedSamples, 1);
+    out.print(isEncodingMsgPack() ? F(" (MessagePack") : F(" (JSON"));
+    out.print(configuration.deltaEncoding ? F(", delta)<br/>") : F(")<br/>"));
+  }
+  out.print(F("HTTP Response: <br/>"));
+  out.escaped(lastHttpResponse);
+  out.print(F("<br/></div>"));
+  webFooter(out);
+}
+
+
+
+void webHandle_GetData() {
+  char str_temp[8];
+  uint8_t sensorCount = getSensorCount();
+  
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, true, F("Data"));
+  out.print(F("<div class=\"position menuitem\">"));
+
+  if (isSensorTypeDS18B20()) {
+    if (sensorCount > 0) {
+      for (uint8_t i=0; i<sensorCount; i++) {
+        copySensorValueToBuffer(i, str_temp);
+        out.print(sensorIds[i]);
+        out.print(F(": "));
+        out.print(str_temp);
+        if (sensorErrors[i].readErrors > 0 || sensorErrors[i].spikes > 0) {
+          out.printf_P(PSTR(" (read errors %lu, spikes %lu)"), (unsigned long) sensorErrors[i].readErrors, (unsigned long) sensorErrors[i].spikes);
+        }
+        out.print(F("<br/>"));
+      }
+    } else {
+      out.print(F("No DS18B20 sensors found on bus"));
+    }
+  } else if (isSensorTypeDHT22()) {
+    out.print(F("Temperature: "));
+    copySensorValueToBuffer(0, str_temp);
+    out.print(str_temp);
+    out.print(F("&deg;C<br/>Humidity: "));
+    copySensorValueToBuffer(1, str_temp);
+    out.print(str_temp);
+    out.printf_P(PSTR("%%<br/>Failed reads: %lu of %lu, spikes %lu/%lu"), (unsigned long) dht22FailedReads, (unsigned long) dht22Reads, 
+      (unsigned long) sensorErrors[0].spikes, (unsigned long) sensorErrors[1].spikes);
+  } else if (isSensorTypeBINARY()) {
+    out.print(F("Binary sensor: ON"));
+  }
+
+  out.print(F("</div>"));
+  webFooter(out);
+}
+
+void webHandle_GetSensorConfig() {
+  char str_deviceid[36];
+  getMacAddressString(str_deviceid);
+
+  // show current configuration
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, true, F("Device/Sensor Config."));
+  out.print(F("<div class=\"position menuitem\"><p>"));
+  out.printf_P(PSTR("Device ID: %s<br/>"), str_deviceid);
+  out.printf_P(PSTR("Current delay print: %lums<br/>"), configuration.delayPrint);
+  out.printf_P(PSTR("Current delay poll: %lums<br/>"), configuration.delayPoll);
+  out.printf_P(PSTR("Current delay post: %lums<br/>"), configuration.delayPost);
+  out.print(F("Current endpoint: "));
+  if (strcmp(configuration.endpoint, "") == 0) {
+    out.print(F("&lt;none configured&gt;"));
+  } else {
+    out.escaped(configuration.endpoint);
+  }
+  out.print(F("<br/>Current JWT: "));
+  if (strcmp(configuration.jwt, "") == 0) {
+    out.print(F("&lt;none configured&gt;"));
+  } else {
+    char str_jwt[16];
+    strncpy(str_jwt, configuration.jwt, 15);
+    str_jwt[15] = '\0';
+    out.escaped(str_jwt);
+    out.print(F("..."));
+  }
+  out.print(F("<br/>Current sensor type: "));
+  out.escaped(configuration.sensorType);
+  out.print(F("<br/>"));
+  if (isSensorTypeDS18B20()) {
+    out.printf_P(PSTR("Current DS18B20 resolution: %u bits"), getDefaultResolution_DS18B20());
+    if (configuration.resolution == 0) out.print(F(" (auto)"));
+    out.print(F("<br/>"));
+  }
+  out.print(F("Send aggregates: ")); out.print(configuration.aggregates ? F("Yes") : F("No")); out.print(F("<br/>"));
+  if (configuration.deadband > 0) {
+    out.print(F("Report by exception - deadband: "));
+    out.print(configuration.deadband, TEMP_DECIMALS);
+    out.printf_P(PSTR(", heartbeat: %lums<br/>"), configuration.delayHeartbeat);
+  } else {
+    out.print(F("Report by exception: No<br/>"));
+  }
+  if (isBatching()) {
+    out.printf_P(PSTR("Batch size: %u, max age: %lums<br/>"), configuration.batchSize, configuration.delayBatch);
+  } else {
+    out.print(F("Batching: No<br/>"));
+  }
+  out.print(F("Encoding: ")); out.print(isEncodingMsgPack() ? F("MessagePack") : F("JSON"));
+  out.print(configuration.deltaEncoding ? F(" (delta encoded batches)<br/>") : F("<br/>"));
+  if (isMqtt()) {
+    out.print(F("Transport: MQTT - broker: "));
+    if (strcmp(configuration.mqttBroker, "") == 0) {
+      out.print(F("&lt;none configured&gt;"));
+    } else {
+      out.escaped(configuration.mqttBroker);
+    }
+    out.print(F(", topic: "));
+    out.escaped(configuration.mqttTopic);
+    out.printf_P(PSTR(", QoS %u%s<br/>"), configuration.mqttQos, configuration.mqttPerSensor ? ", message per sensor" : "");
+  } else {
+    out.print(F("Transport: HTTP<br/>"));
+  }
+  out.print(F("</p>"));
+
+  // add form
+  out.print(F("<form method=\"post\" action=\"/sensor\"><table border=\"0\">"));
+  webFormInput(out, F("Delay, print"), "print");
+  webFormInput(out, F("Delay, poll"), "poll");
+  webFormInput(out, F("Delay, post"), "post");
+  webFormInput(out, F("Deadband (0 = off)"), "deadband");
+  webFormInput(out, F("Delay, heartbeat"), "heartbeat");
+  webFormInput(out, F("Batch size (0 = off)"), "batchsize");
+  webFormInput(out, F("Delay, batch"), "batchdelay");
+  out.print(F("<tr><td align=\"left\">Encoding</td><td><select name=\"encoding\"><option value=\"0\">JSON</option><option value=\"1\""));
+  out.print(isEncodingMsgPack() ? F(" selected") : F(""));
+  out.print(F(">MessagePack</option></select></td></tr>"));
+  webFormCheckbox(out, F("Delta encode batches"), "delta", configuration.deltaEncoding);
+  webFormInput(out, F("Endpoint"), "endpoint");
+  webFormInput(out, F("JWT"), "jwt");
+
+  // MQTT transport
+  out.print(F("<tr><td align=\"left\">Transport</td><td><select name=\"transport\"><option value=\"0\">HTTP</option><option value=\"1\""));
+  out.print(isMqtt() ? F(" selected") : F(""));
+  out.print(F(">MQTT</option></select></td></tr>"));
+  webFormInput(out, F("MQTT broker"), "mqttbroker");
+  webFormInput(out, F("MQTT topic"), "mqtttopic");
+  webFormInput(out, F("MQTT user"), "mqttuser");
+  webFormInput(out, F("MQTT password"), "mqttpassword", "password");
+  out.print(F("<tr><td align=\"left\">MQTT QoS</td><td><select name=\"mqttqos\"><option value=\"0\">0</option><option value=\"1\""));
+  out.print(configuration.mqttQos > 0 ? F(" selected") : F(""));
+  out.print(F(">1</option></select></td></tr>"));
+  webFormCheckbox(out, F("MQTT message per sensor"), "mqttpersensor", configuration.mqttPerSensor);
+
+  out.print(F("<tr><td align=\"left\">Sensor type</td><td><select name=\"sensortype\">"));
+  out.printf_P(PSTR("<option%s>DS18B20</option>"), isSensorTypeDS18B20() ? " selected" : "");
+  out.printf_P(PSTR("<option%s>DHT22</option>"), isSensorTypeDHT22() ? " selected" : "");
+  out.printf_P(PSTR("<option%s>BINARY</option>"), isSensorTypeBINARY() ? " selected" : "");
+  out.print(F("</select></td></tr>"));
+  out.print(F("<tr><td align=\"left\">DS18B20 resolution</td><td><select name=\"resolution\">"));
+  out.printf_P(PSTR("<option value=\"0\"%s>Auto</option>"), configuration.resolution == 0 ? " selected" : "");
+  for (uint8_t res=9; res<=12; res++) {
+    out.printf_P(PSTR("<option%s>%u</option>"), configuration.resolution == res ? " selected" : "", res);
+  }
+  out.print(F("</select></td></tr>"));
+  webFormCheckbox(out, F("Send aggregates"), "aggregates", configuration.aggregates);
+
+  // resolution per DS18B20 sensor
+  if (isSensorTypeDS18B20()) {
+    const uint8_t options[] = {0, 9, 10, 11, 12};
+    for (uint8_t i=0, k=getSensorCount(); i<k; i++) {
+      int8_t idx = findResolutionOverride_DS18B20(sensorAddresses[i]);
+      uint8_t current = idx < 0 ? 0 : configuration.resolutions[idx];
+      out.printf_P(PSTR("<tr><td align=\"left\">%s</td><td><select name=\"res%u\">"), sensorIds[i], i);
+      for (uint8_t j=0; j<sizeof(options); j++) {
+        if (options[j] == 0) {
+          out.printf_P(PSTR("<option value=\"0\"%s>Default</option>"), current == 0 ? " selected" : "");
+        } else {
+          out.printf_P(PSTR("<option%s>%u</option>"), current == options[j] ? " selected" : "", options[j]);
+        }
+      }
+      out.print(F("</select></td></tr>"));
+    }
+  }
+
+  // close page
+  out.print(F("<tr><td colspan=\"2\" align=\"right\"><input type=\"submit\"></input></td></tr></table></form></div>"));
+  webFooter(out);
+}
+
+// configuration changes are made to a staged copy and applied by loop() once 
+// no post is in flight - the request in flight is regenerated for every 
+// slice so must see the configuration it was measured with. The flags say 
+// what has to be restarted, the other values are read as they are used.
+#define CONFIG_CHANGED_ENDPOINT 0x01    // endpoint, JWT, transport or MQTT broker / credentials
+#define CONFIG_CHANGED_SENSORS 0x02     // sensor type
+#define CONFIG_CHANGED_RESOLUTION 0x04  // DS18B20 resolutions
+#define CONFIG_CHANGED_WIFI 0x08        // SSID / password
+#define CONFIG_CHANGED_VALUES 0x10      // stagedConfiguration holds changes
+uint8_t pendingConfigChanges = 0;
+Configuration stagedConfiguration;
+
+/**
+ * The configuration to change - a copy of the applied one until the changes 
+ * already staged are applied.
+ */
+Configuration& editConfiguration() {
+  if (!(pendingConfigChanges & CONFIG_CHANGED_VALUES)) {
+    stagedConfiguration = configuration;
+    pendingConfigChanges |= CONFIG_CHANGED_VALUES;
+  }
+  return stagedConfiguration;
+}
+
+/**
+ * Save the staged configuration - loop() applies it.
+ */
+void saveConfiguration() {
+  EEPROM.put(0, editConfiguration());
+  EEPROM.commit();
+}
+
+bool isTrueValue(const char* value) {
+  return strcmp(value, "1") == 0 || strcmp(value, "true") == 0;
+}
+
+/**
+ * Copy value into a configuration string field if it fits and isn't empty.
+ */
+bool setConfigString(char* field, size_t size, const char* value) {
+  size_t length = strlen(value);
+  if (length == 0 || length >= size) return false;
+  strcpy(field, value);
+  return true;
+}
+
+/**
+ * Set the configuration value named as the fields of the sensor config form 
+ * (shared by the form and the JSON API). Returns true if the configuration 
+ * was updated and false if the name is unknown or the value invalid.
+ */
+bool setConfigValue(const char* name, const char* value) {
+  Configuration& config = editConfiguration();
+  if (strcmp(name, "print") == 0) {
+    unsigned long larg = atol(value);
+    if (larg == 0) return false;
+    config.delayPrint = larg;
+    Serial.print("Delay print: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "poll") == 0) {
+    unsigned long larg = atol(value);
+    if (larg == 0) return false;
+    config.delayPoll = larg;
+    Serial.print("Delay poll: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "post") == 0) {
+    unsigned long larg = atol(value);
+    if (larg == 0) return false;
+    config.delayPost = larg;
+    Serial.print("Delay post: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "deadband") == 0) {
+    float farg = atof(value);
+    if (farg < 0) return false;
+    config.deadband = farg;
+    Serial.print("Deadband: ");
+    Serial.println(farg);
+  } else if (strcmp(name, "heartbeat") == 0) {
+    unsigned long larg = atol(value);
+    if (larg == 0) return false;
+    config.delayHeartbeat = larg;
+    Serial.print("Delay heartbeat: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "batchsize") == 0) {
+    long larg = atol(value);
+    if (larg < 0 || larg > UINT16_MAX) return false;
+    config.batchSize = larg;
+    Serial.print("Batch size: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "batchdelay") == 0) {
+    unsigned long larg = atol(value);
+    if (larg == 0) return false;
+    config.delayBatch = larg;
+    Serial.print("Delay batch: ");
+    Serial.println(larg);
+  } else if (strcmp(name, "endpoint") == 0) {
+    if (!setConfigString(config.endpoint, sizeof(config.endpoint), value)) return false;
+    Serial.print("Endpoint: ");
+    Serial.println(config.endpoint);
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "jwt") == 0) {
+    if (!setConfigString(config.jwt, sizeof(config.jwt), value)) return false;
+    Serial.print("JWT: ");
+    Serial.println(config.jwt);
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "sensortype") == 0) {
+    if (strcmp(value, config.sensorType) == 0) return false;
+    if (!setConfigString(config.sensorType, sizeof(config.sensorType), value)) return false;
+    Serial.print("Sensor type: ");
+    Serial.println(config.sensorType);
+    pendingConfigChanges |= CONFIG_CHANGED_SENSORS;
+  } else if (strcmp(name, "resolution") == 0) {
+    uint8_t res = atoi(value);
+    if (res != 0 && (res < 9 || res > 12)) return false;
+    if (res == config.resolution) return false;
+    config.resolution = res;
+    Serial.print("DS18B20 resolution: ");
+    Serial.println(res);
+    pendingConfigChanges |= CONFIG_CHANGED_RESOLUTION;
+  } else if (strcmp(name, "encoding") == 0) {
+    uint8_t encoding = atoi(value) == ENCODING_MSGPACK ? ENCODING_MSGPACK : ENCODING_JSON;
+    if (encoding == config.encoding) return false;
+    config.encoding = encoding;
+    Serial.print("Encoding: ");
+    Serial.println(encoding);
+  } else if (strcmp(name, "delta") == 0) {
+    bool deltaEncoding = isTrueValue(value);
+    if (deltaEncoding == config.deltaEncoding) return false;
+    config.deltaEncoding = deltaEncoding;
+    Serial.print("Delta encoding: ");
+    Serial.println(deltaEncoding);
+  } else if (strcmp(name, "transport") == 0) {
+    uint8_t transport = atoi(value) == TRANSPORT_MQTT ? TRANSPORT_MQTT : TRANSPORT_HTTP;
+    if (transport == config.transport) return false;
+    config.transport = transport;
+    Serial.print("Transport: ");
+    Serial.println(transport);
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "mqttbroker") == 0) {
+    if (!setConfigString(config.mqttBroker, sizeof(config.mqttBroker), value)) return false;
+    Serial.print("MQTT broker: ");
+    Serial.println(config.mqttBroker);
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "mqtttopic") == 0) {
+    if (!setConfigString(config.mqttTopic, sizeof(config.mqttTopic), value)) return false;
+    Serial.print("MQTT topic: ");
+    Serial.println(config.mqttTopic);
+  } else if (strcmp(name, "mqttuser") == 0) {
+    if (!setConfigString(config.mqttUser, sizeof(config.mqttUser), value)) return false;
+    Serial.print("MQTT user: ");
+    Serial.println(config.mqttUser);
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "mqttpassword") == 0) {
+    if (!setConfigString(config.mqttPassword, sizeof(config.mqttPassword), value)) return false;
+    Serial.println("MQTT password set");
+    pendingConfigChanges |= CONFIG_CHANGED_ENDPOINT;
+  } else if (strcmp(name, "mqttqos") == 0) {
+    uint8_t qos = atoi(value) > 0 ? 1 : 0;
+    if (qos == config.mqttQos) return false;
+    config.mqttQos = qos;
+    Serial.print("MQTT QoS: ");
+    Serial.println(qos);
+  } else if (strcmp(name, "mqttpersensor") == 0) {
+    bool mqttPerSensor = isTrueValue(value);
+    if (mqttPerSensor == config.mqttPerSensor) return false;
+    config.mqttPerSensor = mqttPerSensor;
+    Serial.print("MQTT message per sensor: ");
+    Serial.println(mqttPerSensor);
+  } else if (strcmp(name, "aggregates") == 0) {
+    bool aggregates = isTrueValue(value);
+    if (aggregates == config.aggregates) return false;
+    config.aggregates = aggregates;
+    Serial.print("Send aggregates: ");
+    Serial.println(aggregates);
+  } else if (strncmp(name, "res", 3) == 0 && isdigit(name[3])) {
+    // resolution per DS18B20 sensor
+    uint8_t i = atoi(name + 3);
+    uint8_t res = atoi(value);
+    if (!isSensorTypeDS18B20() || i >= getSensorCount()) return false;
+    if (res != 0 && (res < 9 || res > 12)) return false;
+    int8_t idx = findResolutionOverride_DS18B20(sensorAddresses[i], config);
+    if (res == (idx < 0 ? 0 : config.resolutions[idx])) return false;
+    if (!setResolutionOverride_DS18B20(sensorAddresses[i], res, config)) return false;
+    Serial.print("DS18B20 resolution for <");
+    Serial.print(sensorIds[i]);
+    Serial.print(">: ");
+    Serial.println(res);
+    pendingConfigChanges |= CONFIG_CHANGED_RESOLUTION;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+void webHandle_PostSensorForm() {
+  static const char* const fields[] = {"print", "poll", "post", "deadband", "heartbeat", "batchsize", "batchdelay", 
+    "endpoint", "jwt", "sensortype", "resolution", "encoding", "transport", "mqttbroker", "mqtttopic", "mqttuser", 
+    "mqttpassword", "mqttqos"};
+  static const char* const checkboxes[] = {"delta", "mqttpersensor", "aggregates"};
+  bool didUpdate = false;
+  Serial.println("Received POST for sensor config");
+
+  for (uint8_t i=0; i<sizeof(fields) / sizeof(fields[0]); i++) {
+    if (server.arg(fields[i]).length() == 0) continue;
+    if (setConfigValue(fields[i], server.arg(fields[i]).c_str())) didUpdate = true;
+  }
+
+  // unchecked checkboxes are not posted
+  for (uint8_t i=0; i<sizeof(checkboxes) / sizeof(checkboxes[0]); i++) {
+    if (setConfigValue(checkboxes[i], server.arg(checkboxes[i]).charAt(0) == '1' ? "1" : "0")) didUpdate = true;
+  }
+  for (uint8_t i=0, k=getSensorCount(); i<k && isSensorTypeDS18B20(); i++) {
+    char argName[8];
+    sprintf(argName, "res%u", i);
+    if (server.arg(argName).length() == 0) continue;
+    if (setConfigValue(argName, server.arg(argName).c_str())) didUpdate = true;
+  }
+
+  if (didUpdate) {
+    // save to eeprom - loop() applies the changes
+    saveConfiguration();
+  }
+  webSaved(didUpdate);
+}
+
+void webHandle_GetWifiConfig() {
+  ChunkedResponse out(200, "text/html");
+  webHeader(out, true, F("Wi-Fi Config."));
+  out.print(F("<div class=\"position menuitem\"><p>"));
+  out.print(F("Current SSID: ")); out.escaped(wifi_data.ssid); out.print(F("<br/>"));
+  char str_password[5];
+  strncpy(str_password, wifi_data.password, 4);
+  str_password[4] = '\0';
+  out.print(F("Current Password: ")); out.escaped(str_password); out.print(F("****<br/>"));
+  out.print(F("Keep AP on: ")); out.print(wifi_data.keep_ap_on ? F("Yes") : F("No")); out.print(F("<br/>"));
+  out.print(F("Status: ")); out.print(WiFi.status() == WL_CONNECTED ? F("Connected") : F("NOT connected"));
+  out.printf_P(PSTR("<br/>Outages: %lu, last reconnect took %lums, longest %lums"), 
+    (unsigned long) network.outages, network.lastReconnect, network.longestOutage);
+  out.print(F("</p>"));
+  out.print(F("<form method=\"post\" action=\"/wifi\"><table border=\"0\">"));
+  webFormInput(out, F("SSID"), "ssid");
+  webFormInput(out, F("Password"), "password");
+  webFormCheckbox(out, F("Keep AP on"), "keep_ap_on", false);
+  out.print(F("<tr><td colspan=\"2\" align=\"right\"><input type=\"submit\"></input></td></tr>"));
+  out.print(F("</table></form></div>"));
+  webFooter(out);
+}
+
+void webHandle_PostWifiForm() {
+  Serial.println("Received POST with wifi data");
+  if (!server.hasArg("ssid") || !server.hasArg("password") || server.arg("ssid") == NULL || server.arg("password") == NULL) {
+    server.send(417, "text/plain", "417: Invalid Request");
+    return;
+  }
+
+  // log
+  Serial.print("SSID: ");
+  Serial.println(server.arg("ssid"));
+  Serial.print("Password: ");
+  Serial.println(server.arg("password"));
+  Serial.print("Keep AP on: ");
+  Serial.println(server.arg("keep_ap_on"));
+
+  // save to eeprom
+  server.arg("ssid").toCharArray(wifi_data.ssid, 32);
+  server.arg("password").toCharArray(wifi_data.password, 20);
+  wifi_data.keep_ap_on = (server.arg("keep_ap_on") && server.arg("keep_ap_on").charAt(0) == '1');
+  EEPROM.put(sizeof configuration, wifi_data);
+  EEPROM.commit();
+
+  // send response before loop() switches network
+  webSaved(true);
+  pendingConfigChanges |= CONFIG_CHANGED_WIFI;
+}
+
+/**
+ * Send a gzipped static asset from flash. Assets are cached by the browser 
+ * for a year (pages link them with the ETag in the URL so a new firmware is 
+ * picked up) and revalidating with If-None-Match gets a 304.
+ */
+void webSendAsset(const uint8_t* gz, size_t length, const char* contentType, const char* etag) {
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "public, max-age=31536000, immutable");
+  if (server.hasHeader("If-None-Match") && strstr(server.header("If-None-Match").c_str(), etag)) {
+    server.send(304, contentType, "");
+    return;
+  }
+  server.sendHeader("Content-Encoding", "gzip");
+  server.send_P(200, contentType, (PGM_P) gz, length);
+}
+
+void webHandle_GetStyles() {
+  webSendAsset(ASSET_STYLES_GZ, sizeof(ASSET_STYLES_GZ), "text/css", ASSET_STYLES_ETAG);
+}
+
+/**
+ * Sample history as JSON. Optional arguments are since (only snapshots with 
+ * a higher sequence number) and limit (max number of snapshots, newest first 
+ * are kept). Values are fixed point - divide by scale.
+ */
+void webHandle_GetHistory() {
+  uint32_t from = historyOldestSeq();
+  if (server.hasArg("since")) {
+    uint32_t since = strtoul(server.arg("since").c_str(), NULL, 10);
+    if (since + 1 > from) from = since + 1;
+  }
+  if (server.hasArg("limit")) {
+    uint32_t limit = strtoul(server.arg("limit").c_str(), NULL, 10);
+    if (historySeq >= limit && historySeq - limit + 1 > from) from = historySeq - limit + 1;
+  }
+  char mac_addr[20];
+  getMacAddressString(mac_addr);
+  uint8_t sensorCount = getSensorCount();
+
+  ChunkedResponse response(200, "application/json");
+  response.printf_P(PSTR("{\"deviceId\":\"%s\",\"uptime\":%lu,\"seq\":%lu,\"scale\":%d,\"sensors\":["), 
+    mac_addr, (unsigned long) getUptimeSeconds(), (unsigned long) historySeq, HISTORY_SCALE);
+  for (uint8_t i=0; i<sensorCount; i++) {
+    response.printf_P(i == 0 ? PSTR("\"%s\"") : PSTR(",\"%s\""), sensorIds[i]);
+  }
+  response.print(F("],\"samples\":["));
+  for (uint32_t seq=from; seq<=historySeq; seq++) {
+    int32_t slot = historySlot(seq);
+    if (slot < 0) continue;
+    response.printf_P(seq == from ? PSTR("[%lu") : PSTR(",[%lu"), (unsigned long) historyTimes[slot]);
+    for (uint8_t i=0; i<sensorCount; i++) {
+      if (historyHasValue(slot, i)) {
+        response.printf_P(PSTR(",%d"), historyValues[i][slot]);
+      } else {
+        response.print(F(",null"));
+      }
+    }
+    response.print(F("]"));
+    yield();
+  }
+  response.print(F("]}"));
+  response.end();
+}
+
+// *** JSON API
+// machine readable versions of the pages - data is written by writePayload() 
+// like the posted payloads, and config uses the names of the config form
+Payload apiPayload;
+
+/**
+ * Latest sample of every sensor with the age in seconds and quality flags of 
+ * the sample - the same document as a data post plus age and flags. Uses its 
+ * own payload so a post in progress isn't disturbed.
+ */
+void prepareApiPayload() {
+  startPayload(PAYLOAD_DATA, apiPayload);
+  apiPayload.encoding = ENCODING_JSON;
+  apiPayload.details = true;
+  apiPayload.sensorMask = ALL_SENSORS;
+}
+
+void webHandle_GetApiData() {
+  prepareApiPayload();
+  ChunkedResponse response(200, "application/json");
+  writePayload(response, apiPayload);
+  response.end();
+}
+
+void webHandle_GetApiStatus() {
+  char mac_addr[20];
+  getMacAddressString(mac_addr);
+
+  ChunkedResponse response(200, "application/json");
+  JsonWriter out(response);
+  out.beginObject();
+  out.key("deviceId"); out.value(mac_addr);
+  out.key("version"); out.value(VERSION_NUMBER);
+  out.key("uptime"); out.value(getUptimeSeconds());
+  out.key("freeHeap"); out.value((uint32_t) ESP.getFreeHeap());
+  out.key("transport"); out.value(isMqtt() ? "mqtt" : "http");
+  out.key("lastCode"); out.value((int32_t) lastHttpResponseCode);
+  out.key("lastDuration"); out.value((uint32_t) lastHttpDuration);
+  out.key("lastReused"); out.value(lastHttpReused);
+  out.key("posting"); out.value(isPosting());
+  out.key("breaker");
+  out.beginObject();
+  out.key("state"); out.value(getBreakerStateString());
+  out.key("failures"); out.value((uint32_t) breaker.failures);
+  out.key("wait"); out.value((uint32_t) (breaker.state == BREAKER_OPEN ? getBreakerWait() / 1000 : 0));
+  out.endObject();
+  out.key("paused"); out.value((uint32_t) (isPostPaused() ? getPauseRemaining() / 1000 : 0));
+  out.key("effective");
+  out.beginObject();
+  out.key("poll"); out.value((uint32_t) getDelayPoll());
+  out.key("post"); out.value((uint32_t) getDelayPost());
+  out.key("batchsize"); out.value((uint32_t) getBatchSize());
+  out.endObject();
+  out.key("queue");
+  out.beginObject();
+  out.key("records"); out.value((uint32_t) postQueue.records);
+  out.key("bytes"); out.value((uint32_t) postQueue.bytes);
+  out.key("evicted"); out.value((uint32_t) postQueue.evicted);
+  out.endObject();
+  out.key("bytesPerSample");
+  if (postedSamples > 0) out.value((float) postedBytes / postedSamples); else out.null();
+#ifdef NETWORK_WIFI
+  out.key("wifi");
+  out.beginObject();
+  out.key("connected"); out.value(network.state == NET_ONLINE);
+  out.key("rssi"); out.value((int32_t) WiFi.RSSI());
+  out.key("attempts"); out.value(network.attempts);
+  out.key("outages"); out.value(network.outages);
+  out.key("lastReconnect"); out.value((uint32_t) network.lastReconnect);
+  out.key("longestOutage"); out.value((uint32_t) network.longestOutage);
+  out.endObject();
+#endif
+  out.endObject();
+  response.end();
+}
+
+/**
+ * Configuration keyed by the config form names - secrets are only reported 
+ * as set or not.
+ */
+void webHandle_GetApiConfig() {
+  ChunkedResponse response(200, "application/json");
+  JsonWriter out(response);
+  out.beginObject();
+  out.key("print"); out.value((uint32_t) configuration.delayPrint);
+  out.key("poll"); out.value((uint32_t) configuration.delayPoll);
+  out.key("post"); out.value((uint32_t) configuration.delayPost);
+  out.key("deadband"); out.value(configuration.deadband);
+  out.key("heartbeat"); out.value((uint32_t) configuration.delayHeartbeat);
+  out.key("batchsize"); out.value((uint32_t) configuration.batchSize);
+  out.key("batchdelay"); out.value((uint32_t) configuration.delayBatch);
+  out.key("encoding"); out.value((uint32_t) configuration.encoding);
+  out.key("delta"); out.value(configuration.deltaEncoding);
+  out.key("endpoint"); out.value(configuration.endpoint);
+  out.key("jwt"); out.value(strlen(configuration.jwt) > 0);
+  out.key("sensortype"); out.value(configuration.sensorType);
+  out.key("resolution"); out.value((uint32_t) configuration.resolution);
+  out.key("aggregates"); out.value(configuration.aggregates);
+  out.key("transport"); out.value((uint32_t) configuration.transport);
+  out.key("mqttbroker"); out.value(configuration.mqttBroker);
+  out.key("mqtttopic"); out.value(configuration.mqttTopic);
+  out.key("mqttuser"); out.value(configuration.mqttUser);
+  out.key("mqttpassword"); out.value(strlen(configuration.mqttPassword) > 0);
+  out.key("mqttqos"); out.value((uint32_t) configuration.mqttQos);
+  out.key("mqttpersensor"); out.value(configuration.mqttPerSensor);
+  for (uint8_t i=0, k=getSensorCount(); i<k && isSensorTypeDS18B20(); i++) {
+    char name[8];
+    sprintf(name, "res%u", i);
+    int8_t idx = findResolutionOverride_DS18B20(sensorAddresses[i]);
+    out.key(name); out.value((uint32_t) (idx < 0 ? 0 : configuration.resolutions[idx]));
+  }
+  out.endObject();
+  response.end();
+}
+
+/**
+ * Update the configuration from a JSON object with the same keys as 
+ * webHandle_GetApiConfig() - changes are applied without a restart. Keys 
+ * that are unknown, invalid or unchanged are counted as ignored.
+ */
+void webHandle_PostApiConfig() {
+  Serial.println("Received POST for API config");
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(32) + server.arg("plain").length());
+  DeserializationError error = deserializeJson(doc, server.arg("plain").c_str());
+  if (error || !doc.is<JsonObject>()) {
+    server.send(400, "application/json", "{\"error\":\"Expected a JSON object\"}");
+    return;
+  }
+
+  uint8_t updated = 0;
+  uint8_t ignored = 0;
+  for (JsonPair pair : doc.as<JsonObject>()) {
+    char value[sizeof(configuration.jwt)];
+    if (pair.value().is<const char*>()) {
+      strncpy(value, pair.value().as<const char*>(), sizeof(value) - 1);
+      value[sizeof(value) - 1] = '\0';
+    } else {
+      serializeJson(pair.value(), value, sizeof(value));
+    }
+    if (setConfigValue(pair.key().c_str(), value)) {
+      updated++;
+    } else {
+      ignored++;
+    }
+  }
+
+  if (updated > 0) {
+    // save to eeprom - loop() applies the changes
+    saveConfiguration();
+  }
+  char body[48];
+  sprintf(body, "{\"updated\":%u,\"ignored\":%u}", updated, ignored);
+  server.send(200, "application/json", body);
+}
+
+// *** SERVER-SENT EVENTS
+#ifdef NETWORK_WIFI
+// /events keeps the connection open and gets a sample event (the /api/data 
+// document) after every sensor read. Events are only written when they fit 
+// in the send buffer of a subscriber so a slow one never blocks loop() - it 
+// is dropped after missing EVENT_MAX_SKIPPED events in a row.
+struct EventSubscriber {
+  WiFiClient client;
+  unsigned long lastWrite;
+  uint8_t skipped;                // events in a row without room in the send buffer
+};
+EventSubscriber eventSubscribers[EVENT_SUBSCRIBERS];
+uint32_t eventId = 0;
+
+bool isSubscribed(EventSubscriber& subscriber) {
+  return subscriber.client && subscriber.client.connected();
+}
+
+void dropSubscriber(EventSubscriber& subscriber, const char* reason) {
+  Serial.print("Dropping event subscriber ");
+  Serial.print(subscriber.client.remoteIP());
+  Serial.print(" - ");
+  Serial.println(reason);
+  subscriber.client.stop();
+  subscriber.client = WiFiClient();
+}
+
+void webHandle_GetEvents() {
+  EventSubscriber* subscriber = NULL;
+  for (uint8_t i=0; i<EVENT_SUBSCRIBERS; i++) {
+    if (!isSubscribed(eventSubscribers[i])) {
+      subscriber = &eventSubscribers[i];
+      break;
+    }
+  }
+  if (!subscriber) {
+    server.sendHeader("Retry-After", "30");
+    server.send(503, "text/plain", "503: Too many subscribers");
+    return;
+  }
+
+  // take over the connection from the web server
+  subscriber->client = server.client();
+  subscriber->client.setNoDelay(true);
+  subscriber->client.print(F("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\nretry: 5000\n\n"));
+  subscriber->lastWrite = millis();
+  subscriber->skipped = 0;
+  Serial.print("Event subscriber connected from ");
+  Serial.println(subscriber->client.remoteIP());
+}
+
+void writeSampleEvent(Print& out) {
+  out.printf_P(PSTR("id: %lu\nevent: sample\ndata: "), (unsigned long) eventId);
+  writePayload(out, apiPayload);
+  out.print(F("\n\n"));
+}
+
+/**
+ * Send a sample event to every subscriber with room for it.
+ */
+void publishSampleEvent() {
+  bool any = false;
+  for (uint8_t i=0; i<EVENT_SUBSCRIBERS; i++) {
+    if (eventSubscribers[i].client) any = true;
+  }
+  if (!any) return;
+
+  eventId++;
+  prepareApiPayload();
+  CountingPrint counter;
+  writeSampleEvent(counter);
+
+  for (uint8_t i=0; i<EVENT_SUBSCRIBERS; i++) {
+    EventSubscriber& subscriber = eventSubscribers[i];
+    if (!subscriber.client) continue;
+    if (!isSubscribed(subscriber)) {
+      dropSubscriber(subscriber, "disconnected");
+      continue;
+    }
+    if ((size_t) subscriber.client.availableForWrite() < counter.count) {
+      if (++subscriber.skipped >= EVENT_MAX_SKIPPED) dropSubscriber(subscriber, "too slow");
+      continue;
+    }
+    BufferedPrint out(subscriber.client);
+    writeSampleEvent(out);
+    out.flush();
+    if (out.failed) {
+      dropSubscriber(subscriber, "write failed");
+      continue;
+    }
+    subscriber.skipped = 0;
+    subscriber.lastWrite = millis();
+  }
+}
+
+/**
+ * Call from loop() - sends a comment to idle subscribers so dead connections 
+ * are noticed and proxies keep the stream open.
+ */
+void serviceEvents() {
+  for (uint8_t i=0; i<EVENT_SUBSCRIBERS; i++) {
+    EventSubscriber& subscriber = eventSubscribers[i];
+    if (!subscriber.client) continue;
+    if (!isSubscribed(subscriber)) {
+      dropSubscriber(subscriber, "disconnected");
+    } else if ((millis() - subscriber.lastWrite) > EVENT_KEEPALIVE && subscriber.client.availableForWrite() >= 3) {
+      subscriber.client.print(":\n\n");
+      subscriber.lastWrite = millis();
+    }
+  }
+}
+#endif
+
+// *** PROMETHEUS
+// /metrics in the text exposition format, streamed like the pages
+void writeMetricHeader(Print& out, PGM_P name, PGM_P type, PGM_P help) {
+  out.printf_P(PSTR("# HELP sensorcentral_%S %S\n# TYPE sensorcentral_%S %S\n"), name, help, name, type);
+}
+
+void webHandle_GetMetrics() {
+  static const char* const codeClasses[POST_CODE_CLASSES] = {"error", "1xx", "2xx", "3xx", "4xx", "5xx"};
+  uint8_t sensorCount = getSensorCount();
+
+  ChunkedResponse out(200, "text/plain; version=0.0.4");
+  writeMetricHeader(out, PSTR("info"), PSTR("gauge"), PSTR("Firmware version and configuration"));
+  out.printf_P(PSTR("sensorcentral_info{version=\"" VERSION_NUMBER "\",sensortype=\"%s\",transport=\"%s\"} 1\n"), 
+    configuration.sensorType, isMqtt() ? "mqtt" : "http");
+
+  // sensors - ones without a valid sample have no value
+  writeMetricHeader(out, PSTR("sensor_value"), PSTR("gauge"), PSTR("Latest filtered sample"));
+  for (uint8_t i=0; i<sensorCount; i++) {
+    if (isnan(sensorSamples[i])) continue;
+    out.printf_P(PSTR("sensorcentral_sensor_value{sensor=\"%s\"} "), sensorIds[i]);
+    out.print(sensorSamples[i], 4);
+    out.print('\n');
+  }
+  writeMetricHeader(out, PSTR("sensor_sample_age_seconds"), PSTR("gauge"), PSTR("Time since the latest accepted sample"));
+  for (uint8_t i=0; i<sensorCount; i++) {
+    if (isnan(sensorSamples[i])) continue;
+    out.printf_P(PSTR("sensorcentral_sensor_sample_age_seconds{sensor=\"%s\"} %lu\n"), sensorIds[i], 
+      (millis() - sensorQuality[i].sampledAt) / 1000);
+  }
+  writeMetricHeader(out, PSTR("sensor_read_errors_total"), PSTR("counter"), PSTR("Failed reads and sensor error values"));
+  for (uint8_t i=0; i<sensorCount; i++) {
+    out.printf_P(PSTR("sensorcentral_sensor_read_errors_total{sensor=\"%s\"} %lu\n"), sensorIds[i], (unsigned long) sensorErrors[i].readErrors);
+  }
+  writeMetricHeader(out, PSTR("sensor_spikes_total"), PSTR("counter"), PSTR("Samples rejected as spikes"));
+  for (uint8_t i=0; i<sensorCount; i++) {
+    out.printf_P(PSTR("sensorcentral_sensor_spikes_total{sensor=\"%s\"} %lu\n"), sensorIds[i], (unsigned long) sensorErrors[i].spikes);
+  }
+
+  // posts
+  writeMetricHeader(out, PSTR("posts_total"), PSTR("counter"), PSTR("Posts by response code class"));
+  for (uint8_t i=0; i<POST_CODE_CLASSES; i++) {
+    out.printf_P(PSTR("sensorcentral_posts_total{code=\"%s\"} %lu\n"), codeClasses[i], (unsigned long) postStats.count[i]);
+  }
+  uint32_t posts = 0;
+  for (uint8_t i=0; i<POST_CODE_CLASSES; i++) posts += postStats.count[i];
+  writeMetricHeader(out, PSTR("post_duration_seconds"), PSTR("summary"), PSTR("Time from starting a post to its response"));
+  out.printf_P(PSTR("sensorcentral_post_duration_seconds_sum %lu.%03lu\nsensorcentral_post_duration_seconds_count %lu\n"), 
+    (unsigned long) postStats.durationMillis / 1000, (unsigned long) postStats.durationMillis % 1000, (unsigned long) posts);
+  writeMetricHeader(out, PSTR("posted_bytes_total"), PSTR("counter"), PSTR("Bytes of successful posts carrying samples"));
+  out.printf_P(PSTR("sensorcentral_posted_bytes_total %lu\n"), (unsigned long) postedBytes);
+  writeMetricHeader(out, PSTR("queue_records"), PSTR("gauge"), PSTR("Payloads queued for replay"));
+  out.printf_P(PSTR("sensorcentral_queue_records %lu\n"), (unsigned long) postQueue.records);
+  writeMetricHeader(out, PSTR("breaker_open"), PSTR("gauge"), PSTR("1 while the circuit breaker holds posts back"));
+  out.printf_P(PSTR("sensorcentral_breaker_open %d\n"), breaker.state == BREAKER_OPEN ? 1 : 0);
+
+  // device
+  writeMetricHeader(out, PSTR("heap_free_bytes"), PSTR("gauge"), PSTR("Free heap"));
+  out.printf_P(PSTR("sensorcentral_heap_free_bytes %lu\n"), (unsigned long) ESP.getFreeHeap());
+  writeMetricHeader(out, PSTR("uptime_seconds"), PSTR("counter"), PSTR("Time since boot"));
+  out.printf_P(PSTR("sensorcentral_uptime_seconds %lu\n"), (unsigned long) getUptimeSeconds());
+#ifdef NETWORK_WIFI
+  if (WiFi.status() == WL_CONNECTED) {
+    writeMetricHeader(out, PSTR("wifi_rssi_dbm"), PSTR("gauge"), PSTR("Signal strength of the Wi-Fi connection"));
+    out.printf_P(PSTR("sensorcentral_wifi_rssi_dbm %d\n"), (int) WiFi.RSSI());
+  }
+  writeMetricHeader(out, PSTR("wifi_outages_total"), PSTR("counter"), PSTR("Established Wi-Fi connections lost"));
+  out.printf_P(PSTR("sensorcentral_wifi_outages_total %lu\n"), (unsigned long) network.outages);
+  writeMetricHeader(out, PSTR("wifi_connect_attempts_total"), PSTR("counter"), PSTR("Wi-Fi connection attempts"));
+  out.printf_P(PSTR("sensorcentral_wifi_connect_attempts_total %lu\n"), (unsigned long) network.attempts);
+  writeMetricHeader(out, PSTR("wifi_last_reconnect_seconds"), PSTR("gauge"), PSTR("Duration of the last Wi-Fi outage"));
+  out.printf_P(PSTR("sensorcentral_wifi_last_reconnect_seconds %lu.%03lu\n"), network.lastReconnect / 1000, network.lastReconnect % 1000);
+#endif
+  out.end();
+}
+
+void webHandle_NotFound(){
+  server.send(404, "text/plain", "404: Not found");
+}
+
+void initWebserver() {
+  static const char* headerKeys[] = {"If-None-Match"};
+  server.collectHeaders(headerKeys, sizeof(headerKeys) / sizeof(headerKeys[0]));
+  server.on("/", HTTP_GET, webHandle_GetRoot);
+  server.on("/data.html", HTTP_GET, webHandle_GetData);
+  server.on("/sensorconfig.html", HTTP_GET, webHandle_GetSensorConfig);
+  server.on("/sensor", HTTP_POST, webHandle_PostSensorForm);
+  server.on("/wificonfig.html", HTTP_GET, webHandle_GetWifiConfig);
+  server.on("/wifi", HTTP_POST, webHandle_PostWifiForm);
+  server.on("/httpstatus.html", HTTP_GET, webHandle_GetHttpStatus);
+  server.on("/styles.css", HTTP_GET, webHandle_GetStyles);
+  server.on("/history.json", HTTP_GET, webHandle_GetHistory);
+  server.on("/api/data", HTTP_GET, webHandle_GetApiData);
+  server.on("/api/status", HTTP_GET, webHandle_GetApiStatus);
+  server.on("/api/config", HTTP_GET, webHandle_GetApiConfig);
+  server.on("/api/config", HTTP_POST, webHandle_PostApiConfig);
+#ifdef NETWORK_WIFI
+  server.on("/events", HTTP_GET, webHandle_GetEvents);
+#endif
+  server.on("/metrics", HTTP_GET, webHandle_GetMetrics);
+  server.onNotFound(webHandle_NotFound);  
+  
+}
+
+#ifdef NETWORK_WIFI
+void setNetworkState(uint8_t state) {
+  network.state = state;
+  network.since = millis();
+}
+
+/**
+ * Record the start of an outage of an established connection.
+ */
+void setNetworkLost(const char* reason) {
+  network.outages++;
+  network.offlineSince = millis();
+  Serial.println(reason);
+  setNetworkState(NET_CONNECTING);
+}
+
+void beginWifiConnect() {
+  network.attempts++;
+  Serial.print("Establishing WiFi connection to ");
+  Serial.println(wifi_data.ssid);
+  WiFi.begin(wifi_data.ssid, wifi_data.password);
+  setNetworkState(NET_CONNECTING);
+}
+
+/**
+ * Move the wifi connection along - called from every loop() and never 
+ * blocks. A lost connection is first left to the automatic reconnect of the 
+ * SDK, after that attempts of up to WIFI_CONNECT_TIMEOUT are made with a 
+ * delay doubling from DELAY_CONNECT_ATTEMPT to DELAY_CONNECT_BACKOFF_MAX.
+ */
+void serviceNetwork() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  if (network.state == NET_ONLINE) {
+    if (connected) return;
+    setNetworkLost("WiFi connection lost");
+    return;
+  }
+
+  if (connected) {
+    char ip[16];
+    getIpAddressString(ip);
+    Serial.print("WiFi connection established - IP address: ");
+    Serial.println(ip);
+    if (network.outages > 0) {
+      network.lastReconnect = millis() - network.offlineSince;
+      if (network.lastReconnect > network.longestOutage) network.longestOutage = network.lastReconnect;
+      Serial.print("Reconnected after ");
+      Serial.print(network.lastReconnect);
+      Serial.println("ms");
+    }
+    network.backoff = 0;
+    setNetworkState(NET_ONLINE);
+    return;
+  }
+
+  if (network.state == NET_CONNECTING && (millis() - network.since) > WIFI_CONNECT_TIMEOUT) {
+    network.backoff = network.backoff == 0 ? DELAY_CONNECT_ATTEMPT : min(network.backoff * 2, (unsigned long) DELAY_CONNECT_BACKOFF_MAX);
+    Serial.print("WiFi connection attempt failed - next attempt in ");
+    Serial.print(network.backoff / 1000);
+    Serial.println("s");
+    setNetworkState(NET_OFFLINE);
+  } else if (network.state == NET_OFFLINE && (millis() - network.since) > network.backoff && strlen(wifi_data.ssid) > 0) {
+    beginWifiConnect();
+  }
+}
+#endif
+
+void initNetworking() {
+#ifdef NETWORK_WIFI
+  // read wifi config from eeprom
+  EEPROM.get(sizeof configuration, wifi_data);
+  Serial.println("Read data from EEPROM - ssid: " + String(wifi_data.ssid) + ", password: ****");
+  
+  // start AP
+  char ssid[32];
+  buildNetworkName(ssid);
+  WiFi.softAP(ssid, "");
+  Serial.print("Started AP on IP: ");
+  Serial.println(WiFi.softAPIP());
+
+  // start web server
+  initWebserver();
+  server.begin();
+  Serial.println("Started web server on port 80");
+
+  // get wall clock time for sample timestamps once connected
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+
+  // connect from loop() - see serviceNetwork()
+  if (strlen(wifi_data.ssid) > 0) beginWifiConnect();
+  return;
+#endif
+#ifdef NETWORK_ETHERNET
+  // ensure ethernet library is initialized
+  if (!didEthernetBegin) {
+    Serial.println("Initializing ethernet library");
+    if (Ethernet.begin(ethernetMac) == 0) {
+      Serial.println("Failed to configure Ethernet using DHCP...");
+      if (Ethernet.hardwareStatus() == EthernetNoHardware) {
+        Serial.println("Ethernet shield was not found.  Sorry, can't run without hardware. :(");
+        while (true) {
+          delay(1); // do nothing, no point running without Ethernet hardware
+        }
+      }
+      if (Ethernet.linkStatus() == LinkOFF) {
+        Serial.println("Ethernet cable is not connected...");
+        delay(DELAY_CONNECT_ATTEMPT);
+        return false;
+      }
+    }
+    // give the Ethernet shield a second to initialize:
+    delay(1000);
+    
+    // toggle flag
+    didEthernetBegin = true;
+  }
+  
+  // ensure continued DHCP lease
+  if (Ethernet.maintain() != 0) {
+    Serial.print("Received new DHCP address: ");
+  }
+#endif
+  char ip[16];
+  getIpAddressString(ip);
+  Serial.println(ip);
+}
+
+/**
+ * Split configuration.endpoint (host[:port][/path], optionally prefixed 
+ * with http://) or configuration.mqttBroker (host[:port]) into httpEndpoint 
+ * and drop any cached address / connection.
+ */
+void parseEndpoint() {
+  const char* endpoint = isMqtt() ? configuration.mqttBroker : configuration.endpoint;
+  if (strncmp(endpoint, "http://", 7) == 0) endpoint += 7;
+  if (strncmp(endpoint, "mqtt://", 7) == 0) endpoint += 7;
+  const char* slash = strchr(endpoint, '/');
+  size_t hostLength = slash ? (size_t) (slash - endpoint) : strlen(endpoint);
+  if (hostLength >= sizeof(httpEndpoint.host)) hostLength = sizeof(httpEndpoint.host) - 1;
+  strncpy(httpEndpoint.host, endpoint, hostLength);
+  httpEndpoint.host[hostLength] = '\0';
+  strncpy(httpEndpoint.path, slash ? slash : "/", sizeof(httpEndpoint.path) - 1);
+  httpEndpoint.path[sizeof(httpEndpoint.path) - 1] = '\0';
+
+  char* colon = strchr(httpEndpoint.host, ':');
+  httpEndpoint.port = isMqtt() ? 1883 : 80;
+  if (colon) {
+    httpEndpoint.port = atoi(colon + 1);
+    *colon = '\0';
+  }
+  httpEndpoint.resolved = false;
+  httpEndpoint.client.stop();
+}
+
+/**
+ * Make sure we have an open connection to the endpoint - reuses the open 
+ * connection if there is one and only resolves the host name when the cached 
+ * address is older than DELAY_DNS_CACHE.
+ */
+bool connectEndpoint() {
+  if (httpEndpoint.client.connected()) return true;
+  httpEndpoint.client.stop();
+
+#ifdef NETWORK_WIFI
+  if (!httpEndpoint.resolved || (millis() - httpEndpoint.resolvedAt) > DELAY_DNS_CACHE) {
+    if (!WiFi.hostByName(httpEndpoint.host, httpEndpoint.address, HTTP_CONNECT_TIMEOUT)) {
+      Serial.print("Unable to resolve endpoint host <");
+      Serial.print(httpEndpoint.host);
+      Serial.println(">");
+      httpEndpoint.resolved = false;
+      return false;
+    }
+    httpEndpoint.resolved = true;
+    httpEndpoint.resolvedAt = millis();
+  }
+
+  httpEndpoint.client.setTimeout(HTTP_CONNECT_TIMEOUT);
+  if (!httpEndpoint.client.connect(httpEndpoint.address, httpEndpoint.port)) {
+#endif
+#ifdef NETWORK_ETHERNET
+  // the Ethernet library resolves the host name itself
+  httpEndpoint.client.setConnectionTimeout(HTTP_CONNECT_TIMEOUT);
+  if (!httpEndpoint.client.connect(httpEndpoint.host, httpEndpoint.port)) {
+#endif
+    // address may have changed so resolve again next time
+    Serial.println("Unable to connect to endpoint");
+    httpEndpoint.resolved = false;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Write the request line and headers for a body of length bytes.
+ */
+void writeRequestHeaders(Print& out, size_t length) {
+  out.print("POST "); out.print(httpEndpoint.path); out.print(" HTTP/1.1\r\n");
+  out.print("Host: "); out.print(httpEndpoint.host);
+  if (httpEndpoint.port != 80) {
+    out.print(":"); out.print(httpEndpoint.port);
+  }
+  out.print("\r\n");
+  out.print("Connection: keep-alive\r\n");
+  out.print("Content-Type: "); out.print(getPayloadContentType()); out.print("\r\n");
+  if (strcmp(configuration.jwt, "") != 0) {
+    out.print("Authorization: Bearer "); out.print(configuration.jwt); out.print("\r\n");
+  }
+  out.print("Content-Length: "); out.print((unsigned long) length); out.print("\r\n");
+  out.print("X-SensorCentral-Version: "); out.print(VERSION_NUMBER); out.print("\r\n");
+  out.print("X-SensorCentral-LastChange: "); out.print(VERSION_LASTCHANGE); out.print("\r\n");
+  out.print("\r\n");
+}
+
+/**
+ * Write the body of the post - the prepared payload or a queued one.
+ */
+void writeBody(Print& out) {
+  if (payload.type == PAYLOAD_QUEUED) {
+    queueCopy(out, payload.queuedLength);
+  } else {
+    writePayload(out);
+  }
+}
+
+bool isHttpSuccess(int code) {
+  return code >= 200 && code < 300;
+}
+
+/**
+ * Done with the post in flight - record the result and keep the payload in 
+ * the queue if it failed (or drop it from the queue if it was replayed).
+ */
+void finishPost(int code) {
+  httpPost.state = POST_IDLE;
+  lastHttpResponseCode = code;
+  lastHttpDuration = millis() - httpPost.started;
+  if (code < 0 || !httpPost.keepAlive) httpEndpoint.client.stop();
+  if (code < 0) strcpy(lastHttpResponse, "");
+  Serial.print("Received response code: "); Serial.println(lastHttpResponseCode);
+  Serial.print("Received payload: "); Serial.println(lastHttpResponse);
+  Serial.print("Post took: "); Serial.print(lastHttpDuration); Serial.println(lastHttpReused ? "ms (reused connection)" : "ms (new connection)");
+  breakerRecord(code, code < 0 ? 0 : httpPost.retryAfter);
+  if (isHttpSuccess(code)) applyControl();
+  postStats.count[code < 100 ? 0 : min(code / 100, POST_CODE_CLASSES - 1)]++;
+  postStats.durationMillis += lastHttpDuration;
+
+  if (isHttpSuccess(code)) {
+    // track bytes sent per sensor value - whole requests so protocol overhead counts
+    if (payload.samples > 0) {
+      postedBytes += httpPost.requestLength;
+      postedSamples += payload.samples;
+    }
+    if (payload.type == PAYLOAD_QUEUED) queuePop(payload.queuedLength);
+  } else if (!isRetryable(code)) {
+    // rejected for good - posting it again would fail the same way
+    Serial.println("Payload rejected by endpoint - dropped");
+    if (payload.type == PAYLOAD_QUEUED) {
+      queuePop(payload.queuedLength);
+      postQueue.evicted++;
+    }
+  } else if (payload.type == PAYLOAD_DATA || payload.type == PAYLOAD_BATCH) {
+    if (queueAppend()) {
+      Serial.print("Queued payload for later - queue depth ");
+      Serial.println(postQueue.records);
+    }
+  }
+}
+
+// ******************** MQTT
+// minimal MQTT 3.1.1 publisher using the same request engine as HTTP - the 
+// request is a CONNECT (only on a new connection) followed by a PUBLISH per 
+// message and the response is the CONNACK and, with QoS 1, a PUBACK per 
+// message. The session is persistent and the connection kept open between 
+// posts with PINGREQ. Broker answers are mapped to HTTP status codes so the 
+// queue and circuit breaker work the same for both transports.
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PINGREQ 0xC0
+
+uint16_t mqttPacketId = 0;
+
+void writeMqttLength(Print& out, uint32_t length) {
+  do {
+    uint8_t b = length & 0x7F;
+    length >>= 7;
+    out.write((uint8_t) (length > 0 ? b | 0x80 : b));
+  } while (length > 0);
+}
+
+void writeMqttString(Print& out, const char* str) {
+  uint16_t length = strlen(str);
+  out.write((uint8_t) (length >> 8));
+  out.write((uint8_t) length);
+  out.write((const uint8_t*) str, length);
+}
+
+void writeMqttConnect(Print& out) {
+  char clientId[24] = "sc-";
+  getMacAddressStringNoColon(clientId + 3);
+  bool user = strcmp(configuration.mqttUser, "") != 0;
+  bool password = user && strcmp(configuration.mqttPassword, "") != 0;   // 3.1.1 needs a user for a password
+  uint32_t length = 10 + 2 + strlen(clientId);
+  if (user) length += 2 + strlen(configuration.mqttUser);
+  if (password) length += 2 + strlen(configuration.mqttPassword);
+
+  out.write((uint8_t) MQTT_CONNECT);
+  writeMqttLength(out, length);
+  writeMqttString(out, "MQTT");
+  out.write((uint8_t) 4);               // protocol level 3.1.1
+  out.write((uint8_t) ((user ? 0x80 : 0) | (password ? 0x40 : 0)));   // clean session off
+  out.write((uint8_t) (MQTT_KEEPALIVE >> 8));
+  out.write((uint8_t) MQTT_KEEPALIVE);
+  writeMqttString(out, clientId);
+  if (user) writeMqttString(out, configuration.mqttUser);
+  if (password) writeMqttString(out, configuration.mqttPassword);
+}
+
+/**
+ * Write the PUBLISH packet header for a message of length bytes - the 
+ * message itself is written next.
+ */
+void writeMqttPublishHeader(Print& out, const char* topic, size_t length, uint16_t packetId) {
+  bool qos1 = configuration.mqttQos > 0;
+  out.write((uint8_t) (MQTT_PUBLISH | (qos1 ? 0x02 : 0)));
+  writeMqttLength(out, 2 + strlen(topic) + (qos1 ? 2 : 0) + length);
+  writeMqttString(out, topic);
+  if (qos1) {
+    out.write((uint8_t) (packetId >> 8));
+    out.write((uint8_t) packetId);
+  }
+}
+
+/**
+ * Data payloads are published a message per sensor if so configured - 
+ * everything else as a single message on the device topic.
+ */
+bool isMqttPerSensor() {
+  return configuration.mqttPerSensor && payload.type == PAYLOAD_DATA;
+}
+
+uint8_t getMqttMessageCount() {
+  if (!isMqttPerSensor()) return 1;
+  uint8_t count = 0;
+  for (uint8_t i=0; i<payload.sensorCount; i++) {
+    if (isInDataPayload(payload, i)) count++;
+  }
+  return count;
+}
+
+/**
+ * Topic of the device (<topic>/<device>) or one of its sensors 
+ * (<topic>/<device>/<sensor>) if sensor isn't negative.
+ */
+void getMqttTopic(char* buffer, int8_t sensor) {
+  char mac[16];
+  getMacAddressStringNoColon(mac);
+  sprintf(buffer, "%s/%s", configuration.mqttTopic, mac);
+  if (sensor >= 0) {
+    strcat(buffer, "/");
+    strcat(buffer, payload.ids[sensor]);
+  }
+}
+
+/**
+ * Write the bare value of a sensor in the payload encoding - the message 
+ * published per sensor.
+ */
+void writeSensorValue(Print& print, uint8_t idx) {
+  JsonWriter json(print);
+  MsgPackWriter msgpack(print);
+  PayloadWriter& out = payload.encoding == ENCODING_MSGPACK ? (PayloadWriter&) msgpack : (PayloadWriter&) json;
+  out.value(payload.values[idx]);
+}
+
+void writeMqttRequest(Print& out) {
+  if (httpPost.mqttConnect) writeMqttConnect(out);
+  char topic[96];
+  if (!isMqttPerSensor()) {
+    getMqttTopic(topic, -1);
+    writeMqttPublishHeader(out, topic, httpPost.bodyLength, httpPost.packetId);
+    writeBody(out);
+    return;
+  }
+  uint16_t packetId = httpPost.packetId;
+  for (uint8_t i=0; i<payload.sensorCount; i++) {
+    if (!isInDataPayload(payload, i)) continue;
+    getMqttTopic(topic, i);
+    CountingPrint counter;
+    writeSensorValue(counter, i);
+    writeMqttPublishHeader(out, topic, counter.count, packetId++);
+    writeSensorValue(out, i);
+  }
+}
+
+/**
+ * Reserve consecutive packet ids for the messages of the next request.
+ */
+uint16_t nextMqttPacketIds(uint8_t count) {
+  if (mqttPacketId > UINT16_MAX - MAX_SENSORS) mqttPacketId = 0;
+  uint16_t first = mqttPacketId + 1;
+  mqttPacketId += count;
+  return first;
+}
+
+/**
+ * Feed a byte of broker packets to the parser. Returns true once the CONNACK 
+ * and every PUBACK expected has arrived or the broker refused the connection.
+ */
+bool readMqttResponse(uint8_t c) {
+  switch (httpPost.part) {
+    case RESPONSE_MQTT_TYPE:
+      httpPost.mqttType = c & 0xF0;
+      httpPost.remaining = 0;
+      httpPost.lineLength = 0;
+      httpPost.part = RESPONSE_MQTT_LENGTH;
+      return false;
+
+    case RESPONSE_MQTT_LENGTH:
+      httpPost.remaining |= (size_t) (c & 0x7F) << (7 * httpPost.lineLength++);
+      if (c & 0x80) return false;
+      httpPost.part = RESPONSE_MQTT_BODY;
+      httpPost.lineLength = 0;
+      if (httpPost.remaining > 0) return false;
+      break;
+
+    default:
+      // keep the first bytes, enough for return code / packet id
+      if (httpPost.lineLength < sizeof(httpPost.line)) httpPost.line[httpPost.lineLength++] = c;
+      if (--httpPost.remaining > 0) return false;
+      break;
+  }
+
+  // complete packet
+  httpPost.part = RESPONSE_MQTT_TYPE;
+  if (httpPost.mqttType == MQTT_CONNACK) {
+    uint8_t rc = httpPost.lineLength >= 2 ? httpPost.line[1] : 0xFF;
+    if (rc != 0) {
+      Serial.print("Broker refused connection - return code ");
+      Serial.println(rc);
+      httpPost.code = rc == 4 || rc == 5 ? 401 : 503;
+      httpPost.keepAlive = false;
+      return true;
+    }
+  } else if (httpPost.mqttType == MQTT_PUBACK) {
+    // only count each packet id of this post once - a late PUBACK of an
+    // earlier post or a duplicate must not complete the post early
+    if (httpPost.lineLength < 2) return false;
+    uint16_t message = (((uint16_t) (uint8_t) httpPost.line[0] << 8) | (uint8_t) httpPost.line[1]) - httpPost.packetId;
+    if (message >= getMqttMessageCount() || (httpPost.acked & (1UL << message))) return false;
+    httpPost.acked |= 1UL << message;
+  } else {
+    return false;
+  }
+  if (httpPost.pending > 0) httpPost.pending--;
+  if (httpPost.pending > 0) return false;
+  httpPost.code = 200;
+  return true;
+}
+
+/**
+ * Keep an idle broker connection alive - ping when nothing was sent for half 
+ * the keep alive and drop whatever the broker sends between posts.
+ */
+void serviceMqttIdle() {
+  Client& client = httpEndpoint.client;
+  if (!isMqtt() || !client.connected()) return;
+  while (client.available() > 0) client.read();
+  if ((millis() - httpEndpoint.lastWrite) > MQTT_KEEPALIVE * 500UL && client.availableForWrite() >= 2) {
+    client.write((uint8_t) MQTT_PINGREQ);
+    client.write((uint8_t) 0);
+    httpEndpoint.lastWrite = millis();
+  }
+}
+
+/**
+ * Write the whole request - regenerated for every piece sent.
+ */
+void writeRequest(Print& out) {
+  if (isMqtt()) {
+    writeMqttRequest(out);
+    return;
+  }
+  writeRequestHeaders(out, httpPost.bodyLength);
+  writeBody(out);
+}
+
+/**
+ * (Re)start sending the request from the first byte on the open connection.
+ */
+void beginRequest() {
+  httpPost.state = POST_SENDING;
+  httpPost.sent = 0;
+  httpPost.part = isMqtt() ? RESPONSE_MQTT_TYPE : RESPONSE_STATUS;
+  httpPost.lineLength = 0;
+  httpPost.received = false;
+  httpPost.code = -1;
+  httpPost.keepAlive = isMqtt();
+  httpPost.chunked = false;
+  httpPost.contentLength = -1;
+  httpPost.retryAfter = 0L;
+  httpPost.stored = 0;
+  lastHttpResponse[0] = '\0';
+
+  // a new broker connection needs a CONNECT and everything is acknowledged with QoS 1
+  httpPost.mqttConnect = isMqtt() && !lastHttpReused;
+  httpPost.pending = (httpPost.mqttConnect ? 1 : 0) + (isMqtt() && configuration.mqttQos > 0 ? getMqttMessageCount() : 0);
+  httpPost.acked = 0;
+
+  CountingPrint counter;
+  writeRequest(counter);
+  httpPost.requestLength = counter.count;
+}
+
+/**
+ * The request failed - if it went out on a kept-alive connection the server 
+ * may simply have closed it so start over once on a new connection.
+ */
+void failPost() {
+  if (lastHttpReused && !httpPost.retried && !httpPost.received) {
+    Serial.println("Reused connection failed - reconnecting");
+    httpPost.retried = true;
+    lastHttpReused = false;
+    httpEndpoint.client.stop();
+    if (connectEndpoint()) {
+      beginRequest();
+      return;
+    }
+  }
+  finishPost(-1);
+}
+
+void storeResponseBody(char c) {
+  if (httpPost.stored >= sizeof(lastHttpResponse) - 1) return;
+  lastHttpResponse[httpPost.stored++] = c;
+  lastHttpResponse[httpPost.stored] = '\0';
+}
+
+/**
+ * Handle a complete line of the response (status line, header, chunk size or 
+ * trailer). Returns true when the response is complete.
+ */
+bool readResponseLine(const char* line) {
+  switch (httpPost.part) {
+    case RESPONSE_STATUS:
+      if (sscanf(line, "HTTP/%*d.%*d %d", &httpPost.code) != 1) {
+        httpPost.code = -1;
+        return true;
+      }
+      httpPost.keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+      httpPost.part = RESPONSE_HEADERS;
+      return false;
+
+    case RESPONSE_HEADERS:
+      if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        httpPost.contentLength = atol(line + 15);
+      } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked")) {
+        httpPost.chunked = true;
+      } else if (strncasecmp(line, "Connection:", 11) == 0) {
+        httpPost.keepAlive = strstr(line, "close") == NULL;
+      } else if (strncasecmp(line, "Retry-After:", 12) == 0) {
+        httpPost.retryAfter = parseRetryAfter(line + 12);
+      } else if (line[0] == '\0') {
+        // end of headers - 1xx, 204 and 304 never have a body whatever 
+        // the headers say and a 1xx is followed by the final response
+        if (httpPost.code >= 100 && httpPost.code < 200) {
+          httpPost.part = RESPONSE_STATUS;
+          httpPost.contentLength = -1;
+          httpPost.chunked = false;
+        } else if (httpPost.code == 204 || httpPost.code == 304) {
+          return true;
+        } else if (httpPost.chunked) {
+          httpPost.part = RESPONSE_CHUNK_SIZE;
+        } else if (httpPost.contentLength == 0) {
+          return true;
+        } else if (httpPost.contentLength > 0) {
+          httpPost.remaining = httpPost.contentLength;
+          httpPost.part = RESPONSE_BODY;
+        } else {
+          httpPost.keepAlive = false;
+          httpPost.part = RESPONSE_BODY_TO_CLOSE;
+        }
+      }
+      return false;
+
+    case RESPONSE_CHUNK_SIZE:
+      httpPost.remaining = strtoul(line, NULL, 16);
+      httpPost.part = httpPost.remaining == 0 ? RESPONSE_TRAILER : RESPONSE_CHUNK_DATA;
+      return false;
+
+    case RESPONSE_CHUNK_END:
+      httpPost.part = RESPONSE_CHUNK_SIZE;
+      return false;
+
+    default:
+      // trailer ends with an empty line
+      return line[0] == '\0';
+  }
+}
+
+/**
+ * Feed a byte of the response to the parser keeping what fits of the body 
+ * in lastHttpResponse. The body is always read to the end so the connection 
+ * can be used again. Returns true when the response is complete.
+ */
+bool readResponse(char c) {
+  if (isMqtt()) return readMqttResponse(c);
+  switch (httpPost.part) {
+    case RESPONSE_BODY:
+      storeResponseBody(c);
+      return --httpPost.remaining == 0;
+    case RESPONSE_BODY_TO_CLOSE:
+      storeResponseBody(c);
+      return false;
+    case RESPONSE_CHUNK_DATA:
+      storeResponseBody(c);
+      if (--httpPost.remaining == 0) httpPost.part = RESPONSE_CHUNK_END;
+      return false;
+  }
+
+  // everything else is line based
+  if (c == '\r') return false;
+  if (c != '\n') {
+    if (httpPost.lineLength < sizeof(httpPost.line) - 1) httpPost.line[httpPost.lineLength++] = c;
+    return false;
+  }
+  httpPost.line[httpPost.lineLength] = '\0';
+  httpPost.lineLength = 0;
+  return readResponseLine(httpPost.line);
+}
+
+
+/**
+ * Start posting the prepared payload to the endpoint - servicePost() moves it 
+ * along and finishPost() is called with the result. Only resolving and 
+ * connecting block and only for up to HTTP_CONNECT_TIMEOUT.
+ */
+void startPost() {
+  httpPost.retryAfter = 0L;
+
+  // measure first so the payload can be streamed with a Content-Length
+  httpPost.bodyLength = payload.type == PAYLOAD_QUEUED ? payload.queuedLength : measurePayload();
+  httpPost.started = millis();
+  Serial.print("Sending payload of ");
+  Serial.print((unsigned long) httpPost.bodyLength);
+  Serial.println(" bytes");
+
+  Serial.print("Sending to server: ");
+  Serial.print(httpEndpoint.host);
+  Serial.println(isMqtt() ? configuration.mqttTopic : httpEndpoint.path);
+  if (isMqtt()) httpPost.packetId = nextMqttPacketIds(getMqttMessageCount());
+  httpPost.retried = false;
+  lastHttpReused = httpEndpoint.client.connected();
+  if (!connectEndpoint()) {
+    finishPost(-1);
+    return;
+  }
+  beginRequest();
 }
 
-void initWebserver() {
-  server.on("/", HTTP_GET, webHandle_GetRoot);
-  server.on("/data.html", HTTP_GET, webHandle_GetData);
-  server.on("/sensorconfig.html", HTTP_GET, webHandle_GetSensorConfig);
-  server.on("/sensor", HTTP_POST, webHandle_PostSensorForm);
-  server.on("/wificonfig.html", HTTP_GET, webHandle_GetWifiConfig);
-  server.on("/wifi", HTTP_POST, webHandle_PostWifiForm);
-  server.on("/httpstatus.html", HTTP_GET, webHandle_GetHttpStatus);
-  server.on("/styles.css", HTTP_GET, webHandle_GetStyles);
-  server.onNotFound(webHandle_NotFound);  
-  
-}
+/**
+ * Move the post in flight along - called from every loop(). Writes no more 
+ * than the connection accepts without blocking and reads what has arrived, 
+ * at most HTTP_SLICE_BYTES either way, and gives up at HTTP_REQUEST_DEADLINE.
+ */
+void servicePost() {
+  if (!isPosting()) {
+    serviceMqttIdle();
+    return;
+  }
+  if ((millis() - httpPost.started) > HTTP_REQUEST_DEADLINE) {
+    Serial.println("Post deadline passed - giving up");
+    finishPost(-1);
+    return;
+  }
+  if (payload.type == PAYLOAD_BATCH && historySlot(payload.firstSeq) < 0) {
+    // snapshots being sent were overwritten so the rest of the body would no longer match
+    Serial.println("Batch left the history while posting - giving up");
+    finishPost(-1);
+    return;
+  }
 
-void initNetworking() {
-#ifdef NETWORK_WIFI
-  // read wifi config from eeprom
-  EEPROM.get(sizeof configuration, wifi_data);
-  Serial.println("Read data from EEPROM - ssid: " + String(wifi_data.ssid) + ", password: ****");
-  
-  // start AP
-  char ssid[32];
-  buildNetworkName(ssid);
-  WiFi.softAP(ssid, "");
-  Serial.print("Started AP on IP: ");
-  Serial.println(WiFi.softAPIP());
+  Client& client = httpEndpoint.client;
+  if (httpPost.state == POST_SENDING) {
+    size_t room = client.availableForWrite();
+    if (room == 0) {
+      if (!client.connected()) failPost();
+      return;
+    }
 
-  // start web server
-  initWebserver();
-  server.begin();
-  Serial.println("Started web server on port 80");
+    // regenerate the request and send the next piece of it
+    size_t length = min(min(room, (size_t) HTTP_SLICE_BYTES), httpPost.requestLength - httpPost.sent);
+    BufferedPrint out(client);
+    WindowPrint window(out, httpPost.sent, length);
+    writeRequest(window);
+    out.flush();
+    if (out.failed) {
+      failPost();
+      return;
+    }
+    httpPost.sent += length;
+    httpEndpoint.lastWrite = millis();
+    if (httpPost.sent < httpPost.requestLength) return;
+    httpPost.state = POST_RECEIVING;
 
-  // attempt to start wifi if we have config
-  WiFi.begin(wifi_data.ssid, wifi_data.password);
-  Serial.print("Establishing WiFi connection");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    server.handleClient();
-    Serial.print(".");
-    yield();
+    // nothing to wait for with QoS 0 on an open broker connection
+    if (isMqtt() && httpPost.pending == 0) finishPost(200);
+    return;
   }
-  Serial.print("\n");
-  Serial.print("WiFi connection established - IP address: ");
 
-#endif
-#ifdef NETWORK_ETHERNET
-  // ensure ethernet library is initialized
-  if (!didEthernetBegin) {
-    Serial.println("Initializing ethernet library");
-    if (Ethernet.begin(ethernetMac) == 0) {
-      Serial.println("Failed to configure Ethernet using DHCP...");
-      if (Ethernet.hardwareStatus() == EthernetNoHardware) {
-        Serial.println("Ethernet shield was not found.  Sorry, can't run without hardware. :(");
-        while (true) {
-          delay(1); // do nothing, no point running without Ethernet hardware
-        }
-      }
-      if (Ethernet.linkStatus() == LinkOFF) {
-        Serial.println("Ethernet cable is not connected...");
-        delay(DELAY_CONNECT_ATTEMPT);
-        return false;
+  uint8_t buffer[128];
+  size_t read = 0;
+  while (read < HTTP_SLICE_BYTES && client.available() > 0) {
+    int count = client.read(buffer, min(sizeof(buffer), HTTP_SLICE_BYTES - read));
+    if (count <= 0) break;
+    read += count;
+    httpPost.received = true;
+    for (int i=0; i<count; i++) {
+      if (readResponse(buffer[i])) {
+        finishPost(httpPost.code);
+        return;
       }
     }
-    // give the Ethernet shield a second to initialize:
-    delay(1000);
-    
-    // toggle flag
-    didEthernetBegin = true;
   }
-  
-  // ensure continued DHCP lease
-  if (Ethernet.maintain() != 0) {
-    Serial.print("Received new DHCP address: ");
+  if (client.available() == 0 && !client.connected()) {
+    if (httpPost.part == RESPONSE_BODY_TO_CLOSE) {
+      finishPost(httpPost.code);
+    } else {
+      failPost();
+    }
   }
-#endif
-  char ip[16];
-  getIpAddressString(ip);
-  Serial.println(ip);
 }
 
-void sendData() {
-  // prepare headers
-  uint16_t contentLength = strlen(jsonBuffer) + 4;
-  char str_contentLength[5];
-  sprintf (str_contentLength, "%4i", contentLength);
-  Serial.print("Sending JSON: ");
-  Serial.println(jsonBuffer);
-  
-#ifdef NETWORK_WIFI
-  // send
-  yield();
-  HTTPClient http;
-  char server[70];
-  strcpy(server, "http://");
-  strcat(server, configuration.endpoint);
-  Serial.print("Sending to server: ");
-  Serial.println(server);
-  http.begin(server);
-  http.addHeader("Content-Type", "application/json");
-  if (strcmp(configuration.jwt, "") != 0) {
-    char auth_header[600];
-    strcpy(auth_header, "Bearer ");
-    strcat(auth_header, configuration.jwt);
-    http.addHeader("Authorization", auth_header);
-  }
-  http.addHeader("Content-Length", str_contentLength);
-  Serial.print("Content-Length: ");
-  Serial.println(str_contentLength);
-  http.addHeader("X-SensorCentral-Version", VERSION_NUMBER);
-  http.addHeader("X-SensorCentral-LastChange", VERSION_LASTCHANGE);
-  yield();
-
-  // post data and show respponse
-  lastHttpResponseCode = http.POST(jsonBuffer);
-  http.getString().toCharArray(lastHttpResponse, 2048, 0);
-  Serial.print("Received response code: "); Serial.println(lastHttpResponseCode);
-  Serial.print("Received payload: "); Serial.println(lastHttpResponse);
-  yield();
-  
-  // end http
-  http.end();
-#endif
 
-#ifdef NETWORK_ETHERNET
-  const char *server = isProd ? serverProd : serverTest;
-  if (client.connect(server, 80)) {
-    // post data
-    client.println("POST / HTTP/1.0");
-    client.print  ("Host: "); client.println(server);
-    client.println("Content-Type: application/json");
-    if (strcmp(configuration.jwt, "") != 0) {
-      client.print("Authorization: Bearer "); client.println(configuration.jwt);
-    }
-    client.print  ("Content-Length: "); client.println(str_contentLength);
-    client.print  ("X-SensorCentral-Version: "); client.println(VERSION_NUMBER);
-    client.print  ("X-SensorCentral-LastChange: "); client.println(VERSION_LASTCHANGE);
-    client.println("Connection: close");
-    client.println();
-    client.println(data);
-    client.println();
-    client.flush();
-
-    int len = client.available();
-    if (len > 0) {
-      byte buffer[80];
-      if (len > 80) len = 80;
-      client.read(buffer, len);
-      Serial.write(buffer, len); // show in the serial monitor (slows some boards)
-      
-    }
-  } else {
-    // if you didn't get a connection to the server:
-    Serial.println("connection failed");
+/**
+ * Replay queued payloads once the endpoint accepts posts again - one post at 
+ * a time and no more than QUEUE_REPLAY_BATCH every DELAY_QUEUE_REPLAY. Stops 
+ * at the first retryable failure leaving the payload in the queue. Also makes the 
+ * trial post when the circuit breaker is half-open.
+ */
+void replayQueue() {
+  static unsigned long lastReplay = 0L;
+  static uint8_t replayed = 0;
+  if (isPosting()) return;
+  bool canReplay = postQueue.records > 0 && !isPostPaused() && isBreakerAllowing() && 
+    (breaker.state == BREAKER_HALF_OPEN || !isRetryable(lastHttpResponseCode));
+  if (canReplay && (millis() - lastReplay) > DELAY_QUEUE_REPLAY) {
+    lastReplay = millis();
+    replayed = 0;
+  }
+  if (!canReplay || replayed >= QUEUE_REPLAY_BATCH) {
+    // end of a replay pass - remember how far it got
+    if (postQueue.cursorDirty) queueSaveCursor();
+    return;
   }
-  client.stop();
-#endif
 
-  // done
-  Serial.println("Sent to server...");
-  yield();
+  uint8_t encoding;
+  size_t length = queuePeek(&encoding);
+  if (length == 0) return;
+  payload.type = PAYLOAD_QUEUED;
+  payload.samples = 0;
+  payload.queuedLength = length;
+  payload.queuedEncoding = encoding;
+  Serial.print("Replaying queued payload - ");
+  Serial.print(postQueue.records);
+  Serial.println(" left");
+  replayed++;
+  startPost();
 }
 
 bool isConnectedToNetwork() {
 #ifdef NETWORK_WIFI
-  // wifi
-  if (WiFi.status() != WL_CONNECTED) {
-    initNetworking();
-  }
-  yield();
-  return true;
+  return network.state == NET_ONLINE;
 #endif
 
 #ifdef NETWORK_ETHERNET
@@ -666,61 +3548,20 @@ void debugWebServer(char* buffer) {
 #endif
 }
 
-void preparePayload() {
-  // create document
-  StaticJsonDocument<2048> doc;
-  
-  // get your IP and MAC address
-  char mac_addr[20];
-  getMacAddressString(mac_addr);
-  char ip_addr[16];
-  getIpAddressString(ip_addr);
-
-  // build payload
-  doc["msgtype"] = "data";
-  doc["deviceId"].set(mac_addr);
-  JsonObject deviceData = doc.createNestedObject("deviceData");
-  deviceData["ip"] = ip_addr;
-  JsonArray jsonData = doc.createNestedArray("data");
-
-  // loop sensors and add data
+/**
+ * Called whenever a sensor read has put fresh values in sensorSamples.
+ */
+void processSamples() {
+  historyAppend();
   for (uint8_t i=0, k=getSensorCount(); i<k; i++) {
-    JsonObject jsonSensorData = jsonData.createNestedObject();
-    jsonSensorData["sensorId"].set(sensorIds[i]);
-
-    // add value to json
-    jsonSensorData["sensorValue"].set(sensorSamples[i]);
+    aggregateAdd(i, sensorSamples[i]);
   }
-
-  // serialize
-  serializeJson(doc, jsonBuffer, sizeof(jsonBuffer));
+#ifdef NETWORK_WIFI
+  publishSampleEvent();
+#endif
 }
 
 // ******************** DS18B20
-void initSensor_DS18B20() {
-  // Start up the sensors
-  Serial.println("Initializing DS18B20 sensors");
-  uint8_t count = 0;
-  
-  for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
-    OneWire oneWire(sensorPins[i]);
-    DallasTemperature sensors(&oneWire);
-    sensors.begin();
-    Serial.print("Locating DS18B20 sensors on pin <");
-    Serial.print(sensorPins[i]);
-    Serial.print(">. Found ");
-    Serial.print(sensors.getDeviceCount(), DEC);
-    Serial.println(" DS18B20 sensors.");
-    sensorsPerPin[i] = sensors.getDeviceCount();
-    count += sensorsPerPin[i];
-  }
-  Serial.print("Found <");
-  Serial.print(count);
-  Serial.println("> DS18B20 sensors");
-}
-
-
-
 char* ds18b20AddressToString(DeviceAddress deviceAddress) {
     static char return_me[18];
     static char hex[] = "0123456789ABCDEF";
@@ -735,51 +3576,152 @@ char* ds18b20AddressToString(DeviceAddress deviceAddress) {
     return return_me;
 }
 
-void readData_DS18B20() {
-  uint8_t indexTempAddress = 0;
+/**
+ * Search all buses and rebuild the ROM table in sensorAddresses / sensorIds. 
+ * Only done at startup, every DELAY_DS18B20_RESCAN and after a failed read - 
+ * between scans sensors are read by address.
+ */
+void scanSensors_DS18B20() {
+  uint8_t count = 0;
 
-  // process each pin in turn
   for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
-    OneWire oneWire(sensorPins[i]);
-    DallasTemperature sensors(&oneWire);
-    yield();
-    
-    // begin to scan for change in sensors
-    sensors.begin();
-    sensors.setResolution(DS18B20_TEMP_PRECISION);
-    yield();
-    
-    // get count
-    uint8_t sensorCount = sensorsPerPin[i];
-    uint8_t sensorCountNew = sensors.getDeviceCount();
-    if (sensorCount != sensorCountNew) {
+    DallasTemperature& sensors = ds18b20Buses[i];
+    OneWire& oneWire = oneWireBuses[i];
+
+    // single pass over the bus collecting the ROM codes - sensors are read by 
+    // address so the library's own search in begin() isn't needed
+    uint8_t sensorCountNew = 0;
+    DeviceAddress address;
+    oneWire.reset_search();
+    while (count < MAX_SENSORS && oneWire.search(address)) {
+      if (!sensors.validAddress(address) || !sensors.validFamily(address)) continue;
+      if (memcmp(sensorAddresses[count], address, sizeof(DeviceAddress)) != 0) {
+        // history columns follow the sensor index so start this one over
+        memcpy(sensorAddresses[count], address, sizeof(DeviceAddress));
+        historyClearSensor(count);
+        filterReset(count);
+        reportedSamples[count] = NAN;
+        aggregateReset(1UL << count);
+        memset(&sensorErrors[count], 0, sizeof(SensorErrors));
+        memset(&sensorQuality[count], 0, sizeof(SensorQuality));
+      }
+      strcpy(sensorIds[count], ds18b20AddressToString(sensorAddresses[count]));
+      sensorResolutions[count] = getResolution_DS18B20(sensorAddresses[count]);
+      sensors.setResolution(sensorAddresses[count], sensorResolutions[count], true);
+      count++;
+      sensorCountNew++;
+      yield();
+    }
+
+    if (sensorsPerPin[i] != sensorCountNew) {
       // sensorCount changed
       Serial.print("Detected DS18B20 sensor count change on pin <");
       Serial.print(sensorPins[i]);
       Serial.print("> - was ");
-      Serial.print(sensorCount);
+      Serial.print(sensorsPerPin[i]);
       Serial.print(" now ");
       Serial.println(sensorCountNew);
-      sensorCount = sensorCountNew;
       sensorsPerPin[i] = sensorCountNew;
     }
+  }
 
-    // read temperatures
-    if (sensorCount > 0) {
-      // request temperatures and store
-      sensors.requestTemperatures();
+  // conversions run in parallel so the slowest sensor decides the wait
+  uint8_t resolution = 9;
+  for (uint8_t i=0; i<count; i++) {
+    if (sensorResolutions[i] > resolution) resolution = sensorResolutions[i];
+  }
+  ds18b20ConversionWait = DallasTemperature::millisToWaitForConversion(resolution);
+
+  lastDS18B20Scan = millis();
+  ds18b20RescanNeeded = false;
+}
+
+void initSensor_DS18B20() {
+  // Start up the sensors
+  Serial.println("Initializing DS18B20 sensors");
+  
+  for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
+    oneWireBuses[i].begin(sensorPins[i]);
+    ds18b20Buses[i].setOneWire(&oneWireBuses[i]);
+    ds18b20Buses[i].setWaitForConversion(false);
+  }
+  scanSensors_DS18B20();
+
+  for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
+    Serial.print("Located ");
+    Serial.print(sensorsPerPin[i], DEC);
+    Serial.print(" DS18B20 sensors on pin <");
+    Serial.print(sensorPins[i]);
+    Serial.println(">");
+  }
+  Serial.print("Found <");
+  Serial.print(getSensorCount());
+  Serial.println("> DS18B20 sensors");
+}
+
+/**
+ * Start a temperature conversion on every bus at once and return without 
+ * waiting. The results are picked up by collectData_DS18B20() once the 
+ * conversion time has passed.
+ */
+void startRead_DS18B20() {
+  if (ds18b20ConversionPending) {
+    // previous conversion not collected yet
+    return;
+  }
+
+  // refresh ROM table if due - not while a post is in flight as a rescan may 
+  // reorder the sensors and clear the history the payload is written from
+  if (!isPosting() && (ds18b20RescanNeeded || (millis() - lastDS18B20Scan) > DELAY_DS18B20_RESCAN)) {
+    scanSensors_DS18B20();
+  }
+
+  // start conversion on each bus - returns immediately
+  for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
+    if (sensorsPerPin[i] > 0) {
+      ds18b20Buses[i].requestTemperatures();
       yield();
-      
-      // get addresses
-      for (uint8_t j=0; j<sensorsPerPin[i]; j++) {
-        sensors.getAddress(sensorAddresses[indexTempAddress], j);
-        strcpy(sensorIds[indexTempAddress], ds18b20AddressToString(sensorAddresses[indexTempAddress]));
-        sensorSamples[indexTempAddress] = sensors.getTempCByIndex(j);
-        indexTempAddress++;
-        yield();
+    }
+  }
+
+  // all buses convert in parallel so we only wait for one conversion
+  ds18b20ConversionStarted = millis();
+  ds18b20ConversionPending = true;
+}
+
+/**
+ * Returns true when a conversion has been started and the conversion time 
+ * has passed.
+ */
+bool isConversionDone_DS18B20() {
+  return ds18b20ConversionPending && (millis() - ds18b20ConversionStarted) >= ds18b20ConversionWait;
+}
+
+/**
+ * Read the converted temperatures from every bus by address.
+ */
+void collectData_DS18B20() {
+  uint8_t idx = 0;
+
+  for (uint8_t i=0; i<sizeof(sensorPins)/sizeof(uint8_t); i++) {
+    DallasTemperature& sensors = ds18b20Buses[i];
+    
+    for (uint8_t j=0; j<sensorsPerPin[i]; j++) {
+      float value = sensors.getTempC(sensorAddresses[idx]);
+      if (value == DEVICE_DISCONNECTED_C) {
+        // CRC or read failure - rebuild the ROM table on next poll
+        Serial.print("Failed to read DS18B20 sensor <");
+        Serial.print(sensorIds[idx]);
+        Serial.println(">");
+        ds18b20RescanNeeded = true;
       }
+      storeSample(idx, value);
+      idx++;
+      yield();
     }
   }
+  ds18b20ConversionPending = false;
+  processSamples();
 }
 
 void printData_DS18B20() {
@@ -813,18 +3755,40 @@ void initSensor_DHT22() {
   Serial.print("Humidity ID <");
   Serial.print(sensorIds[1]);
   Serial.println(">");
+  dht.begin();
 }
 
+/**
+ * Read temperature and humidity in a single bus transaction. The sensor 
+ * cannot be sampled more often than every DELAY_DHT22_MIN_INTERVAL so within 
+ * that window the previous reading is kept. Failed reads never overwrite the 
+ * samples.
+ */
 void readData_DHT22() {
-  // init
-  DHT dht(sensorPins[0], DHT_TYPE);
-  dht.begin();
+  if (dht22Reads > 0 && (millis() - lastDHT22Read) < DELAY_DHT22_MIN_INTERVAL) {
+    return;
+  }
+  lastDHT22Read = millis();
+  dht22Reads++;
 
-  // read temperature
-  sensorSamples[0] = dht.readTemperature();
+  // read both values - readTemperature/readHumidity then use the data just read
+  float temperature = NAN;
+  float humidity = NAN;
+  if (dht.read(true)) {
+    temperature = dht.readTemperature();
+    humidity = dht.readHumidity();
+  }
+  if (isnan(temperature) || isnan(humidity)) {
+    dht22FailedReads++;
+    Serial.print("Failed to read DHT22 sensor - failed reads <");
+    Serial.print(dht22FailedReads);
+    Serial.println(">");
+  }
 
-  // read humidity
-  sensorSamples[1] = dht.readHumidity();
+  // filter rejects the NaN's so failed reads never reach sensorSamples
+  bool accepted = storeSample(0, temperature);
+  accepted = storeSample(1, humidity) || accepted;
+  if (accepted) processSamples();
 }
 
 void printData_DHT22() {
@@ -840,6 +3804,10 @@ void printData_DHT22() {
   copySensorValueToBuffer(1, str_temp);
   Serial.print(str_temp);
   Serial.println(" (humidity)");
+  Serial.print("Failed reads: ");
+  Serial.print(dht22FailedReads);
+  Serial.print(" of ");
+  Serial.println(dht22Reads);
 }
 
 // ******************** BINARY
@@ -859,6 +3827,8 @@ void printData_BINARY() {
 }
 void readData_BINARY() {
   sensorSamples[0] = 1;
+  sensorQuality[0].sampledAt = millis();
+  processSamples();
 }
 
 /** 
@@ -884,6 +3854,76 @@ void printData() {
   Serial.println("Printed available data");
 }
 
+void initSensors() {
+  if (isSensorTypeDS18B20()) {
+    // initialize DS18B20 temp sensors
+    initSensor_DS18B20();
+  } else if (isSensorTypeDHT22()) {
+    // initialize DHT22 temp sensor
+    initSensor_DHT22();
+  } else if (isSensorTypeBINARY()) {
+    // init binary sensor
+    initSensor_BINARY();
+  }
+}
+
+/**
+ * Switch sensor driver - everything read from the sensors of the previous 
+ * type is dropped (history columns and ids no longer match) before the 
+ * driver of the configured type is started.
+ */
+void reinitSensors() {
+  memset(sensorsPerPin, 0, sizeof(sensorsPerPin));
+  memset(sensorAddresses, 0, sizeof(sensorAddresses));
+  memset(sensorErrors, 0, sizeof(sensorErrors));
+  memset(sensorQuality, 0, sizeof(sensorQuality));
+  for (uint8_t i=0; i<MAX_SENSORS; i++) {
+    filterReset(i);
+    reportedSamples[i] = NAN;
+  }
+  historyClear();
+  aggregateReset();
+  ds18b20ConversionPending = false;
+  ds18b20RescanNeeded = true;
+  startedRead = false;
+  initSensors();
+}
+
+/**
+ * Apply configuration changes staged by the web handlers - only what the 
+ * change affects is restarted. Waits for a post in flight to finish so its 
+ * request keeps the configuration it was measured with.
+ */
+void applyConfigChanges() {
+  if (pendingConfigChanges == 0 || isPosting()) return;
+  uint8_t changes = pendingConfigChanges;
+  pendingConfigChanges = 0;
+  if (changes & CONFIG_CHANGED_VALUES) configuration = stagedConfiguration;
+
+  if (changes & CONFIG_CHANGED_ENDPOINT) {
+    // a new endpoint starts with a clean slate
+    Serial.println("Endpoint changed - reconnecting");
+    parseEndpoint();
+    breaker.state = BREAKER_CLOSED;
+    breaker.failures = 0;
+  }
+  if (changes & CONFIG_CHANGED_SENSORS) {
+    Serial.println("Sensor type changed - restarting sensor driver");
+    reinitSensors();
+  } else if (changes & CONFIG_CHANGED_RESOLUTION) {
+    // resolutions are applied when the bus is scanned
+    ds18b20RescanNeeded = true;
+  }
+#ifdef NETWORK_WIFI
+  if (changes & CONFIG_CHANGED_WIFI) {
+    Serial.println("Wi-Fi configuration changed - reconnecting");
+    network.backoff = 0;
+    if (network.state == NET_ONLINE) setNetworkLost("WiFi disconnecting from current network");
+    if (strlen(wifi_data.ssid) > 0) beginWifiConnect();
+  }
+#endif
+}
+
 
 /** 
  *  ********************************************
@@ -898,6 +3938,15 @@ void setup() {
   Serial.println(VERSION_LASTCHANGE);
   printMacAddress();
 
+  // spread retries of devices failing together
+  randomSeed(ESP.getChipId() ^ micros());
+
+  // nothing read or reported yet
+  for (uint8_t i=0; i<MAX_SENSORS; i++) {
+    filterReset(i);
+    reportedSamples[i] = NAN;
+  }
+
   // init config
   EEPROM.begin(sizeof configuration + sizeof wifi_data + 10);
   EEPROM.get(0, configuration);
@@ -911,6 +3960,22 @@ void setup() {
     configuration.delayPrint = DEFAULT_DELAY_PRINT;
     configuration.delayPoll = DEFAULT_DELAY_POLL;
     configuration.delayPost = DEFAULT_DELAY_POST;
+    configuration.resolution = 0;
+    memset(configuration.resolutions, 0, sizeof(configuration.resolutions));
+    configuration.aggregates = false;
+    configuration.deadband = 0;
+    configuration.delayHeartbeat = DEFAULT_DELAY_HEARTBEAT;
+    configuration.batchSize = 0;
+    configuration.delayBatch = DEFAULT_DELAY_BATCH;
+    configuration.encoding = ENCODING_JSON;
+    configuration.deltaEncoding = false;
+    configuration.transport = TRANSPORT_HTTP;
+    strcpy(configuration.mqttBroker, "");
+    strcpy(configuration.mqttTopic, DEFAULT_MQTT_TOPIC);
+    strcpy(configuration.mqttUser, "");
+    strcpy(configuration.mqttPassword, "");
+    configuration.mqttQos = 0;
+    configuration.mqttPerSensor = false;
     EEPROM.put(0, configuration);
 
     strcpy(wifi_data.ssid, "");
@@ -952,8 +4017,12 @@ void setup() {
     Serial.println("Undefined sensor type set...");
   }
   
+  // init queue of payloads not yet posted
+  initQueue();
+
   // init networking
   initNetworking();
+  parseEndpoint();
 
   // init pins
 #ifdef PIN_WATCHDOG
@@ -970,16 +4039,7 @@ void setup() {
 #endif
 
   yield();
-  if (isSensorTypeDS18B20()) {
-    // initialize DS18B20 temp sensors
-    initSensor_DS18B20();
-  } else if (isSensorTypeDHT22()) {
-    // initialize DHT22 temp sensor
-    initSensor_DHT22();
-  } else if (isSensorTypeBINARY()) {
-    // init binary sensor
-    initSensor_BINARY();
-  }
+  initSensors();
   yield();
 }
 
@@ -1001,53 +4061,39 @@ void loop() {
 #endif
 
 #ifdef NETWORK_WIFI
-  // handle incoming request to web server
+  // keep the wifi connection up and handle incoming request to web server
+  serviceNetwork();
   server.handleClient();
+  serviceEvents();
 #endif
 
-  if (!isConnectedToNetwork()) {
-    Serial.println("No network connected...");
-    return;
-  }
+  // move any post in flight along and apply saved configuration changes
+  servicePost();
+  applyConfigChanges();
+
+  // sampling carries on while offline - payloads due are queued until the 
+  // network is back
+  bool online = isConnectedToNetwork();
   
-  if (justReset && hasWebEndpoint()) {
+  if (justReset && online && hasEndpoint()) {
     // this is the first run - tell web server we restarted
     yield();
     justReset = false;
     
-    // get your MAC address and IP
-    char mac_addr[20];
-    getMacAddressString(mac_addr);
-    char ip[16];
-    getIpAddressString(ip);
-
-    // build payload
-    StaticJsonDocument<256> doc;
-    doc["msgtype"] = "control";
-    doc["deviceId"].set(mac_addr);
-    JsonObject jsonData = doc.createNestedObject("data"); 
-    jsonData["restart"] = true;
-    jsonData["ip"].set(ip);
-    
-    // serialize
-    serializeJson(doc, jsonBuffer, sizeof(jsonBuffer));
-    
     // send payload
-    sendData();
+    prepareControlPayload();
+    startPost();
     yield();
   }
 
-  // reset reconnect count
-  reconnect = 0;
-
   // read from sensor(s)
-  if (!startedRead && (millis() - lastRead) > configuration.delayPoll) {
+  if (!startedRead && (millis() - lastRead) > getDelayPoll()) {
     lastRead = millis();
     startedRead = true;
 
     // read ds18b20 data
     if (isSensorTypeDS18B20()) {
-      readData_DS18B20();
+      startRead_DS18B20();
     } else if (isSensorTypeDHT22()) {
       readData_DHT22();
     } else if (isSensorTypeBINARY()) {
@@ -1062,6 +4108,12 @@ void loop() {
   }
   yield();
   
+  // collect DS18B20 data once the conversion is done
+  if (isSensorTypeDS18B20() && isConversionDone_DS18B20()) {
+    collectData_DS18B20();
+  }
+  yield();
+  
   if (startedRead && (millis() - lastRead) > DELAY_PAT_WATCHDOG) {
     lastRead = millis();
     startedRead = false;
@@ -1098,8 +4150,23 @@ void loop() {
   }
   yield();
 
-  // post
-  if (!startedPostData && hasWebEndpoint() && ((millis() - lastPostData) > configuration.delayPost)) {
+  // post - either a batch of snapshots, every delayPost or by exception when 
+  // a sensor moved more than the deadband with a full heartbeat every 
+  // delayHeartbeat
+  uint32_t postSensors = 0;
+  bool postBatch = false;
+  if (!startedPostData && !isPosting() && hasEndpoint()) {
+    if (isBatching()) {
+      postBatch = isBatchDue();
+    } else if (!isReportByException()) {
+      if ((millis() - lastPostData) > getDelayPost()) postSensors = ALL_SENSORS;
+    } else if ((millis() - lastPostData) > configuration.delayHeartbeat) {
+      postSensors = ALL_SENSORS;
+    } else {
+      postSensors = getChangedSensors();
+    }
+  }
+  if (postBatch || postSensors != 0) {
     lastPostData = millis();
     startedPostData = true;
     
@@ -1107,12 +4174,30 @@ void loop() {
     digitalWrite(PIN_HTTP_LED, HIGH);
     #endif
     
-    // prepare post data
-    preparePayload();
+    // prepare post data and start a new aggregation window for what's posted
+    if (postBatch) {
+      prepareBatchPayload();
+      aggregateReset();
+    } else {
+      preparePayload(postSensors);
+      aggregateReset(postSensors);
+    }
     yield();
     
-    // send payload
-    sendData();
+    // start sending - finishPost() keeps it for later if it fails - or 
+    // queue it right away while the endpoint is down or asked for a pause
+    if (online && !isPostPaused() && isBreakerAllowing()) {
+      startPost();
+    } else if (queueAppend()) {
+      Serial.print("Not posting now - queued payload, queue depth ");
+      Serial.println(postQueue.records);
+    }
+  }
+  yield();
+
+  // send payloads queued while the endpoint was unavailable
+  if (!startedPostData && online && hasEndpoint()) {
+    replayQueue();
   }
   yield();
 
@@ -0,0 +1,61 @@
+"""
+Compress the static web assets in assets/ into src/assets.h as gzip byte 
+arrays in PROGMEM with an ETag derived from the content.
+
+Runs before every build as a PlatformIO extra script and can also be run 
+by hand (python tools/gen_assets.py). The header is only rewritten when an 
+asset changed so it doesn't trigger rebuilds.
+"""
+import gzip
+import hashlib
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+ASSETS_DIR = os.path.join(PROJECT_DIR, "assets")
+HEADER = os.path.join(PROJECT_DIR, "src", "assets.h")
+
+
+def symbol(filename):
+    return "ASSET_" + re.sub(r"[^A-Za-z0-9]", "_", os.path.splitext(filename)[0]).upper()
+
+
+def render():
+    lines = [
+        "// generated by tools/gen_assets.py from assets/ - do not edit",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+    ]
+    for filename in sorted(os.listdir(ASSETS_DIR)):
+        with open(os.path.join(ASSETS_DIR, filename), "rb") as f:
+            content = f.read()
+        # mtime 0 so the same input always gives the same bytes and ETag
+        compressed = gzip.compress(content, compresslevel=9, mtime=0)
+        name = symbol(filename)
+        etag = hashlib.sha1(content).hexdigest()[:12]
+        lines.append("// %s - %d bytes, %d gzipped" % (filename, len(content), len(compressed)))
+        lines.append('#define %s_VERSION "%s"' % (name, etag))
+        lines.append('#define %s_ETAG "\\"" %s_VERSION "\\""' % (name, name))
+        lines.append("const uint8_t %s_GZ[] PROGMEM = {" % name)
+        for i in range(0, len(compressed), 16):
+            lines.append("  " + ", ".join("0x%02x" % b for b in compressed[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+    return "\n".join(lines)
+
+
+header = render()
+current = None
+if os.path.exists(HEADER):
+    with open(HEADER) as f:
+        current = f.read()
+if header != current:
+    with open(HEADER, "w") as f:
+        f.write(header)
+    print("Generated " + HEADER)